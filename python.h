@@ -8,9 +8,53 @@
 #pragma once
 
 #include <Python.h>
+#include <marshal.h>
+#include <structmember.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <typeinfo>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX  // keep std::min and std::max usable
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define Py_ObjWrap(pobj) \
     { (PyObject*)pobj , false }
 #define Py_ObjectWrap(pobj) \
@@ -161,6 +205,209 @@ namespace Py
         }
     };
 
+    /// <summary>
+    /// Arena allocator for pymalloc backed by huge pages, to cut TLB misses when an interpreter holds many small objects.
+    /// <para>Arenas are carved from regions mapped in 16 MiB chunks as they are needed, up to a limit: explicit huge pages
+    /// (MAP_HUGETLB) while the system has enough of them, otherwise transparent huge pages (MADV_HUGEPAGE), or large pages
+    /// on Windows. Arenas that do not fit, other blocks CPython takes from the arena allocator, and arenas allocated before
+    /// installation go to the previous allocator.</para>
+    /// <para>Freed arenas are kept for reuse rather than returned to the system; the regions live until the process exits.</para>
+    /// </summary>
+    class HugePageArenas
+    {
+    public:
+        enum class Backing
+        {
+            None,         // not installed
+            HugeTLB,      // explicit huge pages
+            Transparent,  // transparent huge pages
+            LargePages,   // Windows large pages
+        };
+
+        struct Stats
+        {
+            Backing backing;
+            size_t reserved;   // bytes mapped so far
+            size_t active;     // arenas currently handed out from the regions
+            size_t peak;       // most arenas handed out from the regions at once
+            size_t allocated;  // total arenas allocated from the regions
+            size_t fallbacks;  // requests passed to the previous allocator
+        };
+
+        /// <summary>
+        /// Map the first chunk and install the regions as the object arena allocator; further chunks are mapped on demand
+        /// until limit bytes are in use. Call it before Initialize so that every arena comes from the regions.
+        /// Returns Backing::None, leaving the allocator unchanged, if huge pages are unavailable; installing twice keeps
+        /// the first setup.
+        /// </summary>
+        static Backing Install(size_t limit = size_t(1) << 30)
+        {
+            State& state = GetState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.backing != Backing::None)
+                return state.backing;
+#ifdef _WIN32
+            size_t page = GetLargePageMinimum();
+            if (page == 0)
+                return Backing::None;
+#else
+            size_t page = HugePage;
+#endif
+            state.chunk = (Chunk + page - 1) / page * page;
+            state.limit = std::max(limit, state.chunk);
+            if (!Grow(state))
+                return Backing::None;
+            PyObject_GetArenaAllocator(&state.previous);
+            PyObjectArenaAllocator allocator{ &state, &Alloc, &Free };
+            PyObject_SetArenaAllocator(&allocator);
+            return state.backing;
+        }
+
+        static Stats GetStats()
+        {
+            State& state = GetState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            return { state.backing, state.chunks.size() * state.chunk, state.active, state.peak, state.allocated, state.fallbacks };
+        }
+
+    private:
+        struct State
+        {
+            std::mutex mutex;  // arenas may be allocated by interpreters with their own GIL
+            PyObjectArenaAllocator previous{ };
+            Backing backing = Backing::None;  // of the first chunk
+            std::vector<char*> chunks;
+            size_t chunk = 0;
+            size_t limit = 0;
+            size_t used = 0;   // bytes handed out from the last chunk
+            size_t arena = 0;  // pymalloc always asks for the same size
+            std::vector<char*> free;
+            size_t active = 0, peak = 0, allocated = 0, fallbacks = 0;
+        };
+
+        static State& GetState()
+        {
+            static State state;
+            return state;
+        }
+
+        static constexpr size_t HugePage = size_t(2) << 20;
+        static constexpr size_t Chunk = size_t(16) << 20;
+        // pymalloc arenas are 1 MiB with the radix tree on 64-bit builds since 3.10, and 256 KiB otherwise.
+        static constexpr size_t SmallArena = size_t(256) << 10;
+        static constexpr size_t LargeArena = size_t(1) << 20;
+
+        /// <summary>
+        /// Map another chunk. Once that fails, or the limit is reached, the regions stop growing.
+        /// </summary>
+        static bool Grow(State& state)
+        {
+            if ((state.chunks.size() + 1) * state.chunk > state.limit)
+                return false;
+            char* p = Map(state, state.chunk);
+            if (p == nullptr)
+            {
+                state.limit = state.chunks.size() * state.chunk;
+                return false;
+            }
+            state.chunks.push_back(p);
+            state.used = 0;
+            return true;
+        }
+
+        static char* Map(State& state, size_t size)
+        {
+#ifdef _WIN32
+            // Fails unless the process holds SeLockMemoryPrivilege. Large pages cannot be committed after reserving,
+            // which is why the regions grow in chunks.
+            void* p = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (p != nullptr && state.backing == Backing::None)
+                state.backing = Backing::LargePages;
+            return (char*)p;
+#else
+            void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            // Without MAP_NORESERVE this fails up front, rather than faulting later, if the huge page pool is too small.
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED && state.backing == Backing::None)
+                state.backing = Backing::HugeTLB;
+#endif
+#ifdef MADV_HUGEPAGE
+            if (p == MAP_FAILED)
+            {
+                // Over-allocate to align the chunk to a huge page, then trim both ends.
+                char* q = (char*)mmap(nullptr, size + HugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (q == (char*)MAP_FAILED)
+                    return nullptr;
+                char* aligned = (char*)(((uintptr_t)q + HugePage - 1) & ~(uintptr_t)(HugePage - 1));
+                if (aligned != q)
+                    munmap(q, aligned - q);
+                if (size_t tail = q + size + HugePage - (aligned + size))
+                    munmap(aligned + size, tail);
+                if (madvise(aligned, size, MADV_HUGEPAGE) != 0)
+                {
+                    munmap(aligned, size);
+                    return nullptr;
+                }
+                p = aligned;
+                if (state.backing == Backing::None)
+                    state.backing = Backing::Transparent;
+            }
+#endif
+            return p == MAP_FAILED ? nullptr : (char*)p;
+#endif
+        }
+
+        static void* Alloc(void* ctx, size_t n)
+        {
+            State& state = *(State*)ctx;
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                // CPython also takes other blocks, such as frame stack chunks, from the arena allocator, so only the
+                // two sizes pymalloc uses are taken as the arena size.
+                if (state.arena == 0 && (n == SmallArena || n == LargeArena))
+                    state.arena = n;
+                char* p = nullptr;
+                if (n == state.arena && !state.free.empty())
+                {
+                    p = state.free.back();
+                    state.free.pop_back();
+                }
+                else if (n == state.arena && (state.chunk - state.used >= n || Grow(state)))
+                {
+                    p = state.chunks.back() + state.used;
+                    state.used += n;
+                }
+                if (p != nullptr)
+                {
+                    state.peak = std::max(state.peak, ++state.active);
+                    ++state.allocated;
+                    return p;
+                }
+                ++state.fallbacks;
+            }
+            return state.previous.alloc(state.previous.ctx, n);
+        }
+
+        static void Free(void* ctx, void* p, size_t n)
+        {
+            State& state = *(State*)ctx;
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                for (char* chunk : state.chunks)
+                {
+                    if ((char*)p >= chunk && (char*)p < chunk + state.chunk)
+                    {
+                        state.free.push_back((char*)p);
+                        --state.active;
+                        return;
+                    }
+                }
+            }
+            state.previous.free(state.previous.ctx, p, n);
+        }
+    };
+
     class U8Str
     {
     public:
@@ -285,7 +532,7 @@ namespace Py
         /// </summary>
         Object& AddRef()
         {
-            Py_IncRef(ptr);  // may be null
+            Py_XINCREF(ptr);  // inline, unlike Py_IncRef
             return *this;
         }
 
@@ -294,8 +541,7 @@ namespace Py
         /// </summary>
         void Release()
         {
-            Py_DecRef(ptr);  // may be null
-            ptr = nullptr;
+            Py_CLEAR(ptr);  // inline, unlike Py_DecRef; clears ptr before a finalizer can run
         }
 
         /// <summary>
@@ -586,6 +832,14 @@ namespace Py
             return ptr != nullptr && PyCoro_CheckExact(ptr);
         }
 
+        /// <summary>
+        /// Determine if this object is an asynchronous generator object (PyAsyncGen_Type).
+        /// </summary>
+        bool IsAsyncGen() const
+        {
+            return ptr != nullptr && PyAsyncGen_CheckExact(ptr);
+        }
+
         /// <summary>
         /// Determine if this object is a code object.
         /// </summary>
@@ -1247,6 +1501,96 @@ namespace Py
         }
     };
 
+    /// <summary>
+    /// Converts C++ values to and from Python objects.
+    /// <para>ToPython returns a new reference or nullptr with an exception set.</para>
+    /// <para>FromPython sets an exception on failure, check with PyErr_Occurred.</para>
+    /// </summary>
+    template<typename T, typename = void>
+    struct Converter;
+
+    template<>
+    struct Converter<bool>
+    {
+        static PyObject* ToPython(bool value) { return PyBool_FromLong(value); }
+        static bool FromPython(PyObject* obj) { return PyObject_IsTrue(obj) == 1; }
+    };
+
+    template<typename T>
+    struct Converter<T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>>
+    {
+        static PyObject* ToPython(T value) { return PyLong_FromLongLong(value); }
+
+        static T FromPython(PyObject* obj)
+        {
+            long long value = PyLong_AsLongLong(obj);
+            if (value == -1 && PyErr_Occurred())
+                return T();
+            if (value < (long long)std::numeric_limits<T>::min() || value > (long long)std::numeric_limits<T>::max())
+            {
+                PyErr_SetString(PyExc_OverflowError, "Python int too large to convert to C++ integer");
+                return T();
+            }
+            return (T)value;
+        }
+    };
+
+    template<typename T>
+    struct Converter<T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T> && !std::is_same_v<T, bool>>>
+    {
+        static PyObject* ToPython(T value) { return PyLong_FromUnsignedLongLong(value); }
+
+        static T FromPython(PyObject* obj)
+        {
+            unsigned long long value = PyLong_AsUnsignedLongLong(obj);
+            if (value == (unsigned long long)-1 && PyErr_Occurred())
+                return T();
+            if (value > (unsigned long long)std::numeric_limits<T>::max())
+            {
+                PyErr_SetString(PyExc_OverflowError, "Python int too large to convert to C++ integer");
+                return T();
+            }
+            return (T)value;
+        }
+    };
+
+    template<typename T>
+    struct Converter<T, std::enable_if_t<std::is_floating_point_v<T>>>
+    {
+        static PyObject* ToPython(T value) { return PyFloat_FromDouble(value); }
+        static T FromPython(PyObject* obj) { return (T)PyFloat_AsDouble(obj); }
+    };
+
+    template<>
+    struct Converter<std::string>
+    {
+        static PyObject* ToPython(const std::string& value) { return PyUnicode_FromStringAndSize(value.data(), value.size()); }
+        static std::string FromPython(PyObject* obj) { return Str(obj); }
+    };
+
+    template<>
+    struct Converter<std::wstring>
+    {
+        static PyObject* ToPython(const std::wstring& value) { return PyUnicode_FromWideChar(value.data(), value.size()); }
+        static std::wstring FromPython(PyObject* obj) { return Str(obj); }
+    };
+
+    template<typename T>
+    struct Converter<T, std::enable_if_t<std::is_base_of_v<Object, T>>>
+    {
+        static PyObject* ToPython(const T& value) { return Py_XNewRef((PyObject*)value); }
+        static T FromPython(PyObject* obj) { return T(obj); }
+    };
+
+    /// <summary>
+    /// Convert a C++ value to a Python object.
+    /// </summary>
+    template<typename T>
+    Object ToObject(const T& value)
+    {
+        return Py_ObjWrap(Converter<T>::ToPython(value));
+    }
+
     class Module : public Object
     {
     public:
@@ -1275,6 +1619,38 @@ namespace Py
         }
     };
 
+    /// <summary>
+    /// Policy tag for Callable::FromFunction: run the C++ function with the GIL released.
+    /// </summary>
+    struct nogil_t
+    {
+        explicit nogil_t() = default;
+    };
+
+    inline constexpr nogil_t nogil { };
+
+    /// <summary>
+    /// Releases the GIL for the lifetime of this object, like Py_BEGIN_ALLOW_THREADS and Py_END_ALLOW_THREADS.
+    /// </summary>
+    class AllowThreads
+    {
+    public:
+        AllowThreads()
+            : state(PyEval_SaveThread())
+        { }
+
+        AllowThreads(const AllowThreads&) = delete;
+        AllowThreads& operator=(const AllowThreads&) = delete;
+
+        ~AllowThreads()
+        {
+            PyEval_RestoreThread(state);
+        }
+
+    private:
+        PyThreadState* state;
+    };
+
     class Callable : public Object
     {
     public:
@@ -1311,6 +1687,47 @@ namespace Py
             ptr = PyCFunction_New(&method, data);
         }
 
+        /// <summary>
+        /// Create a callable from a typed C++ function. Arguments and the result are converted with Converter.
+        /// <para>Invoke recognizes these callables and calls the C++ function directly, without boxing.</para>
+        /// </summary>
+        template<typename R, typename... Args>
+        static Callable FromFunction(R (*fn)(Args...), const char* name = "function")
+        {
+            return FromFunction(fn, (PyCFunction)(void*)&CallTyped<false, R, Args...>, name);
+        }
+
+        /// <summary>
+        /// Create a callable from a typed C++ function whose body runs with the GIL released.
+        /// Arguments are converted before the GIL is released and the result is converted after it is reacquired,
+        /// so the function must not take or return Python objects.
+        /// </summary>
+        template<typename R, typename... Args>
+        static Callable FromFunction(R (*fn)(Args...), nogil_t, const char* name = "function")
+        {
+            static_assert(!IsPython<R>() && (!IsPython<Args>() && ...), "nogil functions must not take or return Python objects");
+            return FromFunction(fn, (PyCFunction)(void*)&CallTyped<true, R, Args...>, name);
+        }
+
+        /// <summary>
+        /// Get the C++ function wrapped by FromFunction, or nullptr if this callable does not wrap one with exactly this signature.
+        /// </summary>
+        template<typename R, typename... Args>
+        auto GetFunction() const -> R (*)(Args...)
+        {
+            if (ptr == nullptr || !PyCFunction_Check(ptr) || (PyCFunction_GetFlags(ptr) & METH_FASTCALL) == 0)
+                return nullptr;
+            PyObject* self = PyCFunction_GetSelf(ptr);
+            if (self == nullptr || !PyCapsule_CheckExact(self))
+                return nullptr;
+            // Same module: same name pointer; across modules the mangled names still compare equal.
+            const char* name = PyCapsule_GetName(self);
+            const char* signature = GetSignature<R, Args...>();
+            if (name == nullptr || (name != signature && std::strcmp(name, signature) != 0))
+                return nullptr;
+            return (R (*)(Args...))static_cast<Binding*>(PyCapsule_GetPointer(self, name))->fn;
+        }
+
         /// <summary>
         /// Call a callable Python object callable without any arguments.
         /// </summary>
@@ -1366,6 +1783,28 @@ namespace Py
             return Py_ObjWrap(PyObject_CallObject(ptr, args));
         }
 
+        /// <summary>
+        /// Call with C++ arguments and convert the result to R.
+        /// If this callable wraps a C++ function with exactly the signature R(Args...), it is called directly.
+        /// Wrappers made with Callable(FunctionKwArgs) take boxed arguments, so they go through vectorcall like any other callable.
+        /// <para>Otherwise the arguments are converted and passed through vectorcall; on failure R{} is returned and an exception is set.</para>
+        /// </summary>
+        template<typename R, typename... Args>
+        R Invoke(Args... args) const
+        {
+            if (R (*fn)(Args...) = GetFunction<R, Args...>())
+                return fn(args...);
+            PyObject* argv[sizeof...(Args) + 1] { Converter<Args>::ToPython(args)... };
+            bool converted = std::all_of(argv, argv + sizeof...(Args), [](PyObject* arg) { return arg != nullptr; });
+            Object result = Py_ObjWrap(converted ? PyObject_Vectorcall(ptr, argv, sizeof...(Args), nullptr) : nullptr);
+            for (size_t i = 0; i < sizeof...(Args); i++)
+                Py_XDECREF(argv[i]);
+            if constexpr (std::is_void_v<R>)
+                return;
+            else
+                return result ? Converter<R>::FromPython(result) : R{ };
+        }
+
         /// <summary>
         /// Call a callable Python object callable without any arguments.
         /// </summary>
@@ -1394,6 +1833,6153 @@ namespace Py
 
     protected:
         PyMethodDef method { };
+
+    private:
+        struct Binding
+        {
+            PyMethodDef method;
+            void (*fn)();
+        };
+
+        template<typename R, typename... Args>
+        static const char* GetSignature()
+        {
+            return typeid(R (*)(Args...)).name();
+        }
+
+        static void DeleteBinding(PyObject* capsule)
+        {
+            delete static_cast<Binding*>(PyCapsule_GetPointer(capsule, PyCapsule_GetName(capsule)));
+        }
+
+        template<typename R, typename... Args>
+        static Callable FromFunction(R (*fn)(Args...), PyCFunction trampoline, const char* name)
+        {
+            Binding* binding = new Binding{ { name, trampoline, METH_FASTCALL, nullptr }, (void (*)())fn };
+            Object capsule = Py_ObjWrap(PyCapsule_New(binding, GetSignature<R, Args...>(), &DeleteBinding));
+            if (!capsule)
+            {
+                delete binding;
+                return { };
+            }
+            return Py_ObjWrap(PyCFunction_New(&binding->method, capsule));
+        }
+
+        template<typename T>
+        static constexpr bool IsPython()
+        {
+            using U = std::remove_cvref_t<T>;
+            return std::is_base_of_v<Object, U> || std::is_same_v<U, PyObject*>;
+        }
+
+        template<bool NoGil, typename R, typename... Args>
+        static PyObject* CallTyped(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+        {
+            if (nargs != sizeof...(Args))
+            {
+                PyErr_Format(PyExc_TypeError, "function takes %zu positional arguments but %zd were given", sizeof...(Args), nargs);
+                return nullptr;
+            }
+            auto fn = (R (*)(Args...))static_cast<Binding*>(PyCapsule_GetPointer(self, GetSignature<R, Args...>()))->fn;
+            return ApplyTyped<NoGil>(fn, args, std::index_sequence_for<Args...>());
+        }
+
+        template<bool NoGil, typename R, typename... Args, size_t... I>
+        static PyObject* ApplyTyped(R (*fn)(Args...), PyObject* const* args, std::index_sequence<I...>)
+        {
+            std::tuple<std::decay_t<Args>...> values { Converter<std::decay_t<Args>>::FromPython(args[I])... };
+            if (PyErr_Occurred())
+                return nullptr;
+            using Result = std::conditional_t<std::is_void_v<R>, std::nullptr_t, std::decay_t<R>>;
+            std::optional<Result> result;
+            try
+            {
+                // Restores the GIL even if the function throws.
+                std::optional<AllowThreads> released;
+                if constexpr (NoGil)
+                    released.emplace();
+                if constexpr (std::is_void_v<R>)
+                    fn(std::get<I>(values)...), result.emplace(nullptr);
+                else
+                    result.emplace(fn(std::get<I>(values)...));
+            }
+            catch (const std::exception& e)
+            {
+                PyErr_SetString(PyExc_RuntimeError, e.what());
+                return nullptr;
+            }
+            if constexpr (std::is_void_v<R>)
+                Py_RETURN_NONE;
+            else
+                return Converter<Result>::ToPython(*result);
+        }
+    };
+
+    /// <summary>
+    /// Calls one callable with a fixed number of positional arguments and a fixed set of keyword names,
+    /// resolving how keywords are passed once instead of on every call.
+    /// <para>For Python functions (and methods bound to them) whose keywords are all positional-or-keyword parameters,
+    /// the keywords are placed in their positional slots and gaps are filled from __defaults__, so the call does no
+    /// name matching at all. Otherwise the call uses vectorcall with a cached tuple of interned keyword names.</para>
+    /// <para>The positional mapping is re-validated on each call by identity of __code__ and __defaults__.</para>
+    /// </summary>
+    class CallPlan
+    {
+    public:
+        CallPlan(const Object& fn, size_t positional, std::initializer_list<const char*> keywords)
+            : fn(fn)
+            , positional(positional)
+            , count(positional + keywords.size())
+        {
+            if (keywords.size() != 0)
+            {
+                kwnames.SetObject(Py_ObjWrap(PyTuple_New(keywords.size())));
+                if (!kwnames)
+                    throw;
+                Py_ssize_t i = 0;
+                for (const char* keyword : keywords)
+                {
+                    PyObject* name = PyUnicode_InternFromString(keyword);
+                    if (name == nullptr)
+                        throw;
+                    PyTuple_SET_ITEM((PyObject*)kwnames, i++, name);
+                }
+            }
+            if (!Resolve())
+                PyErr_Clear();  // not a plain Python function, or not safely mappable
+        }
+
+        /// <summary>
+        /// Determine if keywords are passed positionally.
+        /// </summary>
+        bool IsPositional() const
+        {
+            return (bool)code;
+        }
+
+        /// <summary>
+        /// Call with the positional values followed by the keyword values, in the order given at construction.
+        /// </summary>
+        Object Call(std::span<PyObject* const> args) const
+        {
+            if (args.size() != count)
+            {
+                PyErr_Format(PyExc_TypeError, "call plan expects %zu arguments (%zu given)", count, args.size());
+                return { };
+            }
+            if (code && PyFunction_GET_CODE((PyObject*)target) == (PyObject*)code && PyFunction_GET_DEFAULTS((PyObject*)target) == (PyObject*)defaults)
+            {
+                size_t shift = self ? 1 : 0;
+                size_t size = shift + width;
+                // One spare slot in front lets the callee borrow it (PY_VECTORCALL_ARGUMENTS_OFFSET).
+                PyObject* small[9];
+                std::vector<PyObject*> large(size + 1 > std::size(small) ? size + 1 : 0);
+                PyObject** argv = (large.empty() ? small : large.data()) + 1;
+                if (self)
+                    argv[0] = self;
+                for (size_t i = 0; i < count; ++i)
+                    argv[shift + slots[i]] = args[i];
+                for (const auto& [slot, index] : filled)
+                    argv[shift + slot] = PyTuple_GET_ITEM((PyObject*)defaults, index);
+                return Py_ObjWrap(PyObject_Vectorcall(target, argv, size | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr));
+            }
+            return Py_ObjWrap(PyObject_Vectorcall(fn, args.data(), positional, kwnames));
+        }
+
+        /// <summary>
+        /// Call with the positional values followed by the keyword values, in the order given at construction.
+        /// </summary>
+        template<typename... Args>
+        Object operator()(const Args&... args) const
+        {
+            PyObject* argv[] = { (PyObject*)args..., nullptr };
+            return Call(std::span<PyObject* const>(argv, sizeof...(Args)));
+        }
+
+    private:
+        bool Resolve()
+        {
+            target.SetObject(fn);
+            if (PyMethod_Check((PyObject*)fn))
+            {
+                target.SetObject(Object(PyMethod_GET_FUNCTION((PyObject*)fn)));
+                self.SetObject(Object(PyMethod_GET_SELF((PyObject*)fn)));
+            }
+            if (count == positional || !PyFunction_Check((PyObject*)target))
+                return true;
+            Object function_code(PyFunction_GET_CODE((PyObject*)target));
+            PyCodeObject* info = (PyCodeObject*)(PyObject*)function_code;
+            size_t shift = self ? 1 : 0;
+            size_t first = std::max<size_t>(info->co_posonlyargcount, shift + positional);
+            size_t argcount = info->co_argcount;
+            if (first > argcount)
+                return true;  // keywords would collide with positional arguments, let CPython report it
+            Object varnames = function_code.GetAttr("co_varnames");
+            if (!varnames || !PyTuple_Check((PyObject*)varnames))
+                return false;
+            std::vector<size_t> mapping(count);
+            std::vector<bool> used(argcount, false);
+            for (size_t i = 0; i < positional; ++i)
+                mapping[i] = i;
+            size_t last = shift + positional;
+            for (size_t i = positional; i < count; ++i)
+            {
+                PyObject* name = PyTuple_GET_ITEM((PyObject*)kwnames, i - positional);
+                size_t slot = first;
+                while (slot < argcount && PyUnicode_Compare(PyTuple_GET_ITEM((PyObject*)varnames, slot), name) != 0)
+                    ++slot;
+                if (slot == argcount || used[slot])
+                    return true;  // keyword-only, **kwargs or unknown name
+                used[slot] = true;
+                mapping[i] = slot - shift;
+                last = std::max(last, slot + 1);
+            }
+            // Parameters skipped between the positional arguments and the last keyword take their defaults.
+            Object function_defaults(PyFunction_GET_DEFAULTS((PyObject*)target));
+            size_t ndefaults = function_defaults ? PyTuple_GET_SIZE((PyObject*)function_defaults) : 0;
+            std::vector<std::pair<size_t, size_t>> gaps;
+            for (size_t slot = shift + positional; slot < last; ++slot)
+            {
+                if (used[slot])
+                    continue;
+                if (slot + ndefaults < argcount)
+                    return true;  // a required argument is missing, let CPython report it
+                gaps.emplace_back(slot - shift, slot + ndefaults - argcount);
+            }
+            slots = std::move(mapping);
+            filled = std::move(gaps);
+            width = last - shift;
+            defaults.SetObject(function_defaults);
+            code.SetObject(function_code);
+            return true;
+        }
+
+        Object fn;
+        Object kwnames;
+        size_t positional;
+        size_t count;
+        // Positional mapping, only valid while code is set.
+        Object target;
+        Object self;
+        Object code;
+        Object defaults;
+        std::vector<size_t> slots;
+        std::vector<std::pair<size_t, size_t>> filled;  // (slot, index in __defaults__)
+        size_t width = 0;
+    };
+
+    /// <summary>
+    /// Helper for Python types whose instances store a C++ value of type T inline after the object header.
+    /// <para>The value is constructed by New and destroyed when the instance is deallocated.</para>
+    /// <para>SetFreeListSize opts in to recycling instance memory instead of returning it to the allocator.</para>
+    /// </summary>
+    template<typename T>
+    class NativeType
+    {
+    public:
+        struct Layout
+        {
+            PyObject_HEAD
+            T value;
+        };
+
+        struct FreeListStats
+        {
+            size_t hits = 0;    // instances served from the freelist
+            size_t misses = 0;  // instances allocated with tp_alloc while the freelist was enabled
+            size_t size = 0;    // blocks currently cached
+        };
+
+        /// <summary>
+        /// Get the C++ value stored in an instance.
+        /// </summary>
+        static T& Get(PyObject* self)
+        {
+            return reinterpret_cast<Layout*>(self)->value;
+        }
+
+        /// <summary>
+        /// Get the offset of the C++ value from the start of an instance, e.g. for Py_tp_members entries.
+        /// </summary>
+        static constexpr Py_ssize_t GetOffset()
+        {
+            // Layout is not standard-layout for most T, so offsetof cannot be used.
+            return (sizeof(PyObject) + alignof(T) - 1) / alignof(T) * alignof(T);
+        }
+
+        /// <summary>
+        /// Create a heap type for T. The slot list does not need to be terminated.
+        /// Instances cannot be created from Python unless the slots provide Py_tp_new.
+        /// <para>With Py_TPFLAGS_HAVE_GC, instances are untracked before the value is destroyed.</para>
+        /// </summary>
+        static PyTypeObject* Create(const char* name, std::vector<PyType_Slot> slots, unsigned int flags = Py_TPFLAGS_DEFAULT)
+        {
+            bool has_new = false;
+            for (const PyType_Slot& slot : slots)
+                has_new |= slot.slot == Py_tp_new;
+            if (!has_new)
+                flags |= Py_TPFLAGS_DISALLOW_INSTANTIATION;
+            slots.push_back({ Py_tp_dealloc, (void*)&Dealloc });
+            slots.push_back({ 0, nullptr });
+            PyType_Spec spec { name, (int)sizeof(Layout), 0, flags, slots.data() };
+            return (PyTypeObject*)PyType_FromSpec(&spec);
+        }
+
+        /// <summary>
+        /// Create an instance of the specified type, constructing its value from the arguments.
+        /// Returns a new reference, or nullptr with an exception set.
+        /// </summary>
+        template<typename... Args>
+        static PyObject* New(PyTypeObject* type, Args&&... args)
+        {
+            PyObject* self = Reuse(type);
+            if (self == nullptr)
+                self = type->tp_alloc(type, 0);
+            if (self == nullptr)
+                return nullptr;
+            // tp_alloc tracks GC instances, but tp_traverse must not see the value before it is constructed.
+            bool gc = PyType_IS_GC(type);
+            if (gc)
+                PyObject_GC_UnTrack(self);
+            try
+            {
+                new (&Get(self)) T(std::forward<Args>(args)...);
+            }
+            catch (const std::bad_alloc&)
+            {
+                Discard(type, self);
+                PyErr_NoMemory();
+                return nullptr;
+            }
+            catch (const std::exception& e)
+            {
+                Discard(type, self);
+                PyErr_SetString(PyExc_RuntimeError, e.what());
+                return nullptr;
+            }
+            catch (...)
+            {
+                Discard(type, self);
+                PyErr_SetString(PyExc_RuntimeError, "unknown C++ exception");
+                return nullptr;
+            }
+            if (gc)
+                PyObject_GC_Track(self);
+            return self;
+        }
+
+        /// <summary>
+        /// Keep up to the specified number of deallocated instances per interpreter and reuse their memory in New.
+        /// 0 disables recycling. Types with Py_TPFLAGS_HAVE_GC are never recycled.
+        /// <para>Cached blocks are released with the interpreter, or by ClearFreeList.</para>
+        /// </summary>
+        static void SetFreeListSize(size_t capacity)
+        {
+            freelist_capacity.store(capacity, std::memory_order_relaxed);
+        }
+
+        /// <summary>
+        /// Get the freelist counters of the current interpreter.
+        /// </summary>
+        static FreeListStats GetFreeListStats()
+        {
+            FreeList* list = GetFreeList(false);
+            return list ? FreeListStats{ list->hits, list->misses, list->blocks.size() } : FreeListStats{ };
+        }
+
+        /// <summary>
+        /// Release the blocks cached by the current interpreter.
+        /// </summary>
+        static void ClearFreeList()
+        {
+            if (FreeList* list = GetFreeList(false))
+                list->Clear();
+        }
+
+    private:
+        struct FreeList
+        {
+            void Clear()
+            {
+                for (PyObject* block : blocks)
+                    release(block);
+                blocks.clear();
+            }
+
+            std::vector<PyObject*> blocks;
+            freefunc release = nullptr;  // tp_free of the type that allocated the blocks
+            bool closed = false;      // the interpreter is being finalized
+            size_t hits = 0;
+            size_t misses = 0;
+        };
+
+        /// <summary>
+        /// Get the freelist of the current interpreter, optionally creating it.
+        /// <para>Each thread caches the last list it used. A list is emptied and closed when its interpreter's state dict
+        /// is cleared; closing bumps an epoch so that no thread keeps using it for a new interpreter at the same address.
+        /// Closed lists are kept, never deleted, so a cached pointer is always safe to read.</para>
+        /// </summary>
+        static FreeList* GetFreeList(bool create)
+        {
+            PyInterpreterState* interp = PyInterpreterState_Get();
+            uint64_t epoch = freelist_epoch.load(std::memory_order_acquire);
+            if (interp == freelist_cache.interp && epoch == freelist_cache.epoch)
+                return freelist_cache.list;
+            FreeList* list = FindFreeList(interp, create);
+            if (list != nullptr)
+                freelist_cache = { interp, epoch, list };
+            return list;
+        }
+
+        static FreeList* FindFreeList(PyInterpreterState* interp, bool create)
+        {
+            static std::mutex mutex;
+            static std::unordered_map<PyInterpreterState*, FreeList*> lists;
+            static std::vector<std::unique_ptr<FreeList>> all;
+            std::lock_guard lock(mutex);
+            auto it = lists.find(interp);
+            if (it != lists.end() && it->second->closed)
+            {
+                lists.erase(it);
+                it = lists.end();
+            }
+            if (it == lists.end())
+            {
+                PyObject* dict = create ? PyInterpreterState_GetDict(interp) : nullptr;
+                if (dict == nullptr)
+                    return nullptr;
+                auto list = std::make_unique<FreeList>();
+                Object capsule = Py_ObjWrap(PyCapsule_New(list.get(), nullptr, &CloseFreeList));
+                std::string key = std::string("Py.FreeList:") + typeid(T).name();
+                if (!capsule || PyDict_SetItemString(dict, key.c_str(), capsule) != 0)
+                {
+                    PyErr_Clear();  // run without a freelist
+                    return nullptr;
+                }
+                it = lists.emplace(interp, list.get()).first;
+                all.push_back(std::move(list));
+            }
+            return it->second;
+        }
+
+        static void CloseFreeList(PyObject* capsule)
+        {
+            FreeList* list = static_cast<FreeList*>(PyCapsule_GetPointer(capsule, nullptr));
+            list->Clear();
+            list->closed = true;
+            freelist_epoch.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        static bool CanRecycle(PyTypeObject* type)
+        {
+            return type->tp_basicsize == (Py_ssize_t)sizeof(Layout) && type->tp_itemsize == 0 && !PyType_IS_GC(type);
+        }
+
+        /// <summary>
+        /// Get a recycled instance with its header initialized, or nullptr.
+        /// </summary>
+        static PyObject* Reuse(PyTypeObject* type)
+        {
+            if (freelist_capacity.load(std::memory_order_relaxed) == 0 || !CanRecycle(type))
+                return nullptr;
+            FreeList* list = GetFreeList(true);
+            if (list == nullptr || list->closed)
+                return nullptr;
+            if (list->blocks.empty() || list->release != type->tp_free)
+            {
+                ++list->misses;
+                return nullptr;
+            }
+            ++list->hits;
+            PyObject* self = list->blocks.back();
+            list->blocks.pop_back();
+            return PyObject_Init(self, type);  // takes a reference to a heap type, like tp_alloc
+        }
+
+        /// <summary>
+        /// Keep the memory of a deallocated instance if there is room.
+        /// </summary>
+        static bool Recycle(PyTypeObject* type, PyObject* self)
+        {
+            size_t capacity = freelist_capacity.load(std::memory_order_relaxed);
+            if (capacity == 0 || !CanRecycle(type))
+                return false;
+            FreeList* list = GetFreeList(false);
+            if (list == nullptr || list->closed || list->blocks.size() >= capacity)
+                return false;
+            if (list->blocks.empty())
+                list->release = type->tp_free;
+            else if (list->release != type->tp_free)
+                return false;
+            list->blocks.push_back(self);
+            return true;
+        }
+
+        /// <summary>
+        /// Free an instance whose value was never constructed, bypassing Dealloc.
+        /// </summary>
+        static void Discard(PyTypeObject* type, PyObject* self)
+        {
+            type->tp_free(self);
+            Py_DECREF(type);
+        }
+
+        static void Dealloc(PyObject* self)
+        {
+            PyTypeObject* type = Py_TYPE(self);
+            if (PyType_IS_GC(type))
+                PyObject_GC_UnTrack(self);
+            Get(self).~T();
+            if (!Recycle(type, self))
+                type->tp_free(self);
+            Py_DECREF(type);  // heap type instances own a reference to their type
+        }
+
+        static inline std::atomic<size_t> freelist_capacity = 0;
+        static inline std::atomic<uint64_t> freelist_epoch = 0;
+
+        struct FreeListCache
+        {
+            PyInterpreterState* interp = nullptr;
+            uint64_t epoch = 0;
+            FreeList* list = nullptr;
+        };
+
+        static inline thread_local FreeListCache freelist_cache;
+    };
+
+    /// <summary>
+    /// Callable that prepends bound positional arguments and adds bound keyword arguments, like functools.partial,
+    /// implemented with vectorcall so that the extra layer costs next to nothing per call.
+    /// <para>With a single bound argument, the argument is written into the slot in front of the caller's arguments
+    /// when PY_VECTORCALL_ARGUMENTS_OFFSET allows it, so nothing is copied. Keywords given in the call override bound ones.</para>
+    /// </summary>
+    class Partial : public Object
+    {
+    public:
+        Partial(const Object& obj)
+            : Object(obj)
+        { }
+
+        Partial(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Bind leading positional arguments and, optionally, keyword arguments given as a dict.
+        /// </summary>
+        Partial(const Object& fn, std::initializer_list<Object> args, const Object& kwargs = nullptr)
+            : Object(New(fn, args, kwargs), false)
+        { }
+
+    private:
+        struct State
+        {
+            vectorcallfunc vectorcall = &Vectorcall;  // must stay the first member, see GetType
+            PyObject* fn = nullptr;
+            std::vector<PyObject*> args;
+            PyObject* kwnames = nullptr;
+            std::vector<PyObject*> kwvalues;
+
+            ~State()
+            {
+                Clear();
+            }
+
+            void Clear()
+            {
+                Py_CLEAR(fn);
+                Py_CLEAR(kwnames);
+                for (PyObject*& arg : args)
+                    Py_CLEAR(arg);
+                for (PyObject*& value : kwvalues)
+                    Py_CLEAR(value);
+                args.clear();
+                kwvalues.clear();
+            }
+        };
+
+        static PyObject* New(const Object& fn, std::initializer_list<Object> args, const Object& kwargs)
+        {
+            if (!PyCallable_Check(fn))
+            {
+                PyErr_SetString(PyExc_TypeError, "the first argument must be callable");
+                return nullptr;
+            }
+            if (kwargs && !PyDict_Check((PyObject*)kwargs))
+            {
+                PyErr_SetString(PyExc_TypeError, "keywords must be a dict");
+                return nullptr;
+            }
+            PyObject* self = NativeType<State>::New(GetType());
+            if (self == nullptr)
+                return nullptr;
+            State& state = NativeType<State>::Get(self);
+            state.fn = Py_NewRef((PyObject*)fn);
+            for (const Object& arg : args)
+                state.args.push_back(Py_NewRef((PyObject*)arg));
+            Py_ssize_t count = kwargs ? PyDict_GET_SIZE((PyObject*)kwargs) : 0;
+            if (count != 0)
+            {
+                state.kwnames = PyTuple_New(count);
+                if (state.kwnames == nullptr)
+                {
+                    Py_DECREF(self);
+                    return nullptr;
+                }
+                Py_ssize_t pos = 0, i = 0;
+                PyObject* key;
+                PyObject* value;
+                while (PyDict_Next(kwargs, &pos, &key, &value))
+                {
+                    if (!PyUnicode_Check(key))
+                    {
+                        PyErr_SetString(PyExc_TypeError, "keywords must be strings");
+                        Py_DECREF(self);
+                        return nullptr;
+                    }
+                    PyTuple_SET_ITEM(state.kwnames, i++, Py_NewRef(key));
+                    state.kwvalues.push_back(Py_NewRef(value));
+                }
+            }
+            return self;
+        }
+
+        static PyTypeObject* GetType()
+        {
+            static PyMemberDef members[] = {
+                { "__vectorcalloffset__", T_PYSSIZET, NativeType<State>::GetOffset(), READONLY, nullptr },
+                { }
+            };
+            static PyGetSetDef getset[] = {
+                { "func", (getter)&PyFunc, nullptr, "Function object to use in future partial calls.", nullptr },
+                { "args", (getter)&PyArgs, nullptr, "Tuple of arguments to future partial calls.", nullptr },
+                { "keywords", (getter)&PyKeywords, nullptr, "Dictionary of keyword arguments to future partial calls.", nullptr },
+                { }
+            };
+            static PyTypeObject* type = NativeType<State>::Create("Py.Partial", {
+                { Py_tp_call, (void*)&PyVectorcall_Call },
+                { Py_tp_traverse, (void*)&Traverse },
+                { Py_tp_clear, (void*)&ClearSlot },
+                { Py_tp_members, (void*)members },
+                { Py_tp_getset, (void*)getset },
+            }, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_VECTORCALL);
+            return type;
+        }
+
+        static PyObject* Vectorcall(PyObject* self, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+        {
+            State& state = NativeType<State>::Get(self);
+            if (state.fn == nullptr)
+            {
+                PyErr_SetString(PyExc_ReferenceError, "partial was cleared");
+                return nullptr;
+            }
+            Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+            size_t bound = state.args.size();
+            if (bound == 0 && state.kwnames == nullptr)
+                return PyObject_Vectorcall(state.fn, args, nargsf, kwnames);
+            if (bound == 1 && state.kwnames == nullptr && (nargsf & PY_VECTORCALL_ARGUMENTS_OFFSET))
+            {
+                // The caller lent us args[-1]; it must be restored before returning.
+                PyObject** argv = const_cast<PyObject**>(args) - 1;
+                PyObject* saved = argv[0];
+                argv[0] = state.args[0];
+                PyObject* result = PyObject_Vectorcall(state.fn, argv, nargs + 1, kwnames);
+                argv[0] = saved;
+                return result;
+            }
+            Py_ssize_t ncall = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+            Object names(kwnames);
+            std::vector<PyObject*> extra;  // bound keywords that the call does not override
+            if (state.kwnames != nullptr)
+            {
+                if (ncall == 0)
+                    names.SetObject(Object(state.kwnames));
+                else
+                {
+                    std::vector<PyObject*> merged;
+                    for (size_t i = 0; i < state.kwvalues.size(); ++i)
+                    {
+                        PyObject* name = PyTuple_GET_ITEM(state.kwnames, i);
+                        Py_ssize_t j = 0;
+                        while (j < ncall && PyUnicode_Compare(PyTuple_GET_ITEM(kwnames, j), name) != 0)
+                            ++j;
+                        if (j == ncall)
+                        {
+                            merged.push_back(name);
+                            extra.push_back(state.kwvalues[i]);
+                        }
+                    }
+                    names.SetObject(Py_ObjWrap(PyTuple_New(ncall + merged.size())));
+                    if (!names)
+                        return nullptr;
+                    for (Py_ssize_t j = 0; j < ncall; ++j)
+                        PyTuple_SET_ITEM((PyObject*)names, j, Py_NewRef(PyTuple_GET_ITEM(kwnames, j)));
+                    for (size_t i = 0; i < merged.size(); ++i)
+                        PyTuple_SET_ITEM((PyObject*)names, ncall + i, Py_NewRef(merged[i]));
+                }
+            }
+            const std::vector<PyObject*>& kwvalues = ncall == 0 ? state.kwvalues : extra;
+            size_t size = bound + nargs + ncall + kwvalues.size();
+            // One spare slot in front so that the callee can use PY_VECTORCALL_ARGUMENTS_OFFSET too.
+            PyObject* small[16];
+            std::vector<PyObject*> large(size + 1 > std::size(small) ? size + 1 : 0);
+            PyObject** argv = (large.empty() ? small : large.data()) + 1;
+            std::copy(state.args.begin(), state.args.end(), argv);
+            std::copy(args, args + nargs + ncall, argv + bound);
+            std::copy(kwvalues.begin(), kwvalues.end(), argv + bound + nargs + ncall);
+            // Bound arguments are kept alive by the partial, which the caller holds for the duration of the call.
+            return PyObject_Vectorcall(state.fn, argv, (bound + nargs) | PY_VECTORCALL_ARGUMENTS_OFFSET, names ? (PyObject*)names : nullptr);
+        }
+
+        static int Traverse(PyObject* self, visitproc visit, void* arg)
+        {
+            State& state = NativeType<State>::Get(self);
+            Py_VISIT(Py_TYPE(self));
+            Py_VISIT(state.fn);
+            for (PyObject* value : state.args)
+                Py_VISIT(value);
+            for (PyObject* value : state.kwvalues)
+                Py_VISIT(value);
+            return 0;
+        }
+
+        static int ClearSlot(PyObject* self)
+        {
+            NativeType<State>::Get(self).Clear();
+            return 0;
+        }
+
+        static PyObject* PyFunc(PyObject* self, void*)
+        {
+            PyObject* fn = NativeType<State>::Get(self).fn;
+            return Py_NewRef(fn ? fn : Py_None);
+        }
+
+        static PyObject* PyArgs(PyObject* self, void*)
+        {
+            const std::vector<PyObject*>& args = NativeType<State>::Get(self).args;
+            PyObject* tuple = PyTuple_New(args.size());
+            for (size_t i = 0; tuple != nullptr && i < args.size(); ++i)
+                PyTuple_SET_ITEM(tuple, i, Py_NewRef(args[i]));
+            return tuple;
+        }
+
+        static PyObject* PyKeywords(PyObject* self, void*)
+        {
+            const State& state = NativeType<State>::Get(self);
+            PyObject* dict = PyDict_New();
+            for (size_t i = 0; dict != nullptr && i < state.kwvalues.size(); ++i)
+            {
+                if (PyDict_SetItem(dict, PyTuple_GET_ITEM(state.kwnames, i), state.kwvalues[i]) != 0)
+                    Py_CLEAR(dict);
+            }
+            return dict;
+        }
+    };
+
+    /// <summary>
+    /// Per-class record of which methods of an Overridable type a Python subclass overrides.
+    /// It is stored in the subclass's __dict__, so it lives exactly as long as the class.
+    /// </summary>
+    struct OverrideTable
+    {
+        static constexpr const char* Key = "__cpp_overrides__";
+
+        std::vector<Object> functions;  // null if the method is not overridden; only read while holding the GIL
+        std::atomic<uint64_t> mask = 0;  // bit i is set if functions[i] is not null
+        std::atomic<bool> stale = false;  // set by the type watcher
+        unsigned int version = 0;  // tp_version_tag when the table was resolved, for interpreters without type watchers
+
+#if PY_VERSION_HEX >= 0x030C0000
+        /// <summary>
+        /// Get the type watcher of the current interpreter that marks the tables of modified classes as stale,
+        /// registering it on first use in each interpreter. Returns -1 with an exception set if none can be added.
+        /// </summary>
+        static int GetWatcher()
+        {
+            // Watcher ids are per interpreter. Interpreter ids, unlike their addresses, are never reused.
+            static std::mutex mutex;  // subinterpreters may have their own GIL
+            static std::map<int64_t, int> watchers;
+            int64_t interp = PyInterpreterState_GetID(PyInterpreterState_Get());
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = watchers.find(interp);
+            if (it != watchers.end())
+                return it->second;
+            int watcher = PyType_AddWatcher([](PyTypeObject* type) -> int
+            {
+                PyObject* capsule = PyDict_GetItemString(type->tp_dict, Key);  // borrowed, never raises
+                if (capsule != nullptr)
+                    static_cast<std::shared_ptr<OverrideTable>*>(PyCapsule_GetPointer(capsule, Key))->get()->stale.store(true, std::memory_order_release);
+                return 0;
+            });
+            if (watcher >= 0)
+                watchers.emplace(interp, watcher);
+            return watcher;
+        }
+#endif
+    };
+
+    /// <summary>
+    /// Base for C++ classes whose virtual methods can be overridden by Python subclasses.
+    /// <para>Derived is the trampoline: each virtual hook first calls CallOverride with the index of its method name
+    /// and falls back to the C++ implementation. Which methods a Python class overrides is resolved once per class
+    /// and cached; the cache is invalidated when the class or one of its bases is modified, through a type watcher
+    /// on Python 3.12+ and through the type version tag before that.</para>
+    /// <para>Plain C++ instances, and hooks a Python class does not override, never touch Python or the GIL.</para>
+    /// <para>If an override raises, the exception is reported with PyErr_WriteUnraisable and the C++ implementation is used.</para>
+    /// </summary>
+    template<typename Derived>
+    class Overridable
+    {
+    public:
+        /// <summary>
+        /// Create the Python type for Derived. Python classes deriving from it can override the named methods;
+        /// the slots should define them too (e.g. in Py_tp_methods) so that super() reaches the C++ implementation.
+        /// Derived must be default-constructible to be instantiated from Python.
+        /// </summary>
+        static PyTypeObject* CreateType(const char* name, std::vector<const char*> methods, std::vector<PyType_Slot> slots = { })
+        {
+            if (methods.size() > 64)
+            {
+                PyErr_SetString(PyExc_ValueError, "at most 64 methods can be overridden");
+                return nullptr;
+            }
+            GetMethods() = std::move(methods);
+            if constexpr (std::is_default_constructible_v<Derived>)
+                slots.push_back({ Py_tp_new, (void*)&PyNew });
+            GetBaseType() = NativeType<Derived>::Create(name, std::move(slots), Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE);
+            return GetBaseType();
+        }
+
+        /// <summary>
+        /// Create an instance of the type from C++.
+        /// </summary>
+        template<typename... Args>
+        static Object New(Args&&... args)
+        {
+            PyObject* self = NativeType<Derived>::New(GetBaseType(), std::forward<Args>(args)...);
+            if (self != nullptr)
+                NativeType<Derived>::Get(self).self = self;
+            return Py_ObjWrap(self);
+        }
+
+        /// <summary>
+        /// Get the C++ object of an instance of the type or of a Python subclass.
+        /// </summary>
+        static Derived& Get(PyObject* self)
+        {
+            return NativeType<Derived>::Get(self);
+        }
+
+        /// <summary>
+        /// Get the Python object this C++ object lives in, or nullptr for a plain C++ object.
+        /// </summary>
+        PyObject* GetSelf() const
+        {
+            return self;
+        }
+
+    protected:
+        using Result = std::nullptr_t;  // CallOverride<void> yields this when an override ran
+
+        /// <summary>
+        /// Call the Python override of the method with the specified index, if the object's class has one.
+        /// Returns std::nullopt if the C++ implementation should run instead. Acquires the GIL only if there is an override.
+        /// </summary>
+        template<typename R, typename... Args>
+        auto CallOverride(size_t method, Args... args) const -> std::optional<std::conditional_t<std::is_void_v<R>, Result, R>>
+        {
+            if (table == nullptr)
+                return std::nullopt;
+            if (!IsStale() && (table->mask.load(std::memory_order_acquire) & (uint64_t(1) << method)) == 0)
+                return std::nullopt;
+            PyGILState_STATE gil = PyGILState_Ensure();
+            if (IsStale())
+                Resolve(Py_TYPE(self), *table);
+            std::optional<std::conditional_t<std::is_void_v<R>, Result, R>> result;
+            if (PyObject* fn = table->functions[method])
+            {
+                PyObject* argv[] { self, Converter<Args>::ToPython(args)... };
+                bool converted = std::all_of(argv, argv + sizeof...(Args) + 1, [](PyObject* arg) { return arg != nullptr; });
+                Object value = Py_ObjWrap(converted ? PyObject_Vectorcall(fn, argv, sizeof...(Args) + 1, nullptr) : nullptr);
+                for (size_t i = 1; i <= sizeof...(Args); i++)
+                    Py_XDECREF(argv[i]);
+                if constexpr (std::is_void_v<R>)
+                {
+                    if (value)
+                        result.emplace(nullptr);
+                }
+                else if (value)
+                {
+                    R converted_value = Converter<R>::FromPython(value);
+                    if (!PyErr_Occurred())
+                        result.emplace(std::move(converted_value));
+                }
+                if (PyErr_Occurred())
+                    PyErr_WriteUnraisable(fn);
+            }
+            PyGILState_Release(gil);
+            return result;
+        }
+
+    private:
+        static std::vector<const char*>& GetMethods()
+        {
+            static std::vector<const char*> methods;
+            return methods;
+        }
+
+        static PyTypeObject*& GetBaseType()
+        {
+            static PyTypeObject* type = nullptr;
+            return type;
+        }
+
+        bool IsStale() const
+        {
+#if PY_VERSION_HEX >= 0x030C0000
+            return table->stale.load(std::memory_order_acquire);
+#else
+            // Read without the GIL: a torn or outdated read only causes an extra resolution under the GIL.
+            PyTypeObject* type = Py_TYPE(self);
+            return (type->tp_flags & Py_TPFLAGS_VALID_VERSION_TAG) == 0 || type->tp_version_tag != table->version;
+#endif
+        }
+
+        /// <summary>
+        /// Find the overridden methods of a class. Must be called while holding the GIL.
+        /// </summary>
+        static void Resolve(PyTypeObject* type, OverrideTable& table)
+        {
+            // Clear the flag first so that a modification during resolution marks the table stale again.
+            table.stale.store(false, std::memory_order_release);
+            const std::vector<const char*>& methods = GetMethods();
+            table.functions.resize(methods.size());
+            uint64_t mask = 0;
+            for (size_t i = 0; i < methods.size(); ++i)
+            {
+                Object base = Py_ObjWrap(PyObject_GetAttrString((PyObject*)GetBaseType(), methods[i]));
+                Object attr = Py_ObjWrap(PyObject_GetAttrString((PyObject*)type, methods[i]));
+                PyErr_Clear();
+                bool overridden = attr && (PyObject*)attr != (PyObject*)base;
+                table.functions[i].SetObject(overridden ? attr : Object());
+                if (overridden)
+                    mask |= uint64_t(1) << i;
+            }
+            table.mask.store(mask, std::memory_order_release);
+#if PY_VERSION_HEX >= 0x030C0000
+            // Watchers are only notified for types with a valid version tag.
+            PyUnstable_Type_AssignVersionTag(type);
+#else
+            // The lookups above assign a version tag whenever CPython can.
+            table.version = (type->tp_flags & Py_TPFLAGS_VALID_VERSION_TAG) ? type->tp_version_tag : 0;
+#endif
+        }
+
+        /// <summary>
+        /// Get the override table of a Python subclass, creating it the first time an instance is created.
+        /// </summary>
+        static std::shared_ptr<OverrideTable> GetTable(PyTypeObject* type)
+        {
+            PyObject* capsule = PyDict_GetItemString(type->tp_dict, OverrideTable::Key);
+            if (capsule != nullptr)
+                return *static_cast<std::shared_ptr<OverrideTable>*>(PyCapsule_GetPointer(capsule, OverrideTable::Key));
+            auto table = std::make_shared<OverrideTable>();
+            auto holder = new std::shared_ptr<OverrideTable>(table);
+            Object object = Py_ObjWrap(PyCapsule_New(holder, OverrideTable::Key, [](PyObject* capsule)
+            {
+                delete static_cast<std::shared_ptr<OverrideTable>*>(PyCapsule_GetPointer(capsule, OverrideTable::Key));
+            }));
+            if (!object)
+            {
+                delete holder;
+                return nullptr;
+            }
+            // Stored directly so that the class is not reported as modified.
+            if (PyDict_SetItemString(type->tp_dict, OverrideTable::Key, object) != 0)
+                return nullptr;
+#if PY_VERSION_HEX >= 0x030C0000
+            if (PyType_Watch(OverrideTable::GetWatcher(), (PyObject*)type) != 0)
+                return nullptr;
+#endif
+            Resolve(type, *table);
+            return table;
+        }
+
+        static PyObject* PyNew(PyTypeObject* type, PyObject*, PyObject*)
+        {
+            PyObject* self = NativeType<Derived>::New(type);
+            if (self == nullptr)
+                return nullptr;
+            Overridable& object = NativeType<Derived>::Get(self);
+            object.self = self;
+            if (type != GetBaseType())
+            {
+                object.table = GetTable(type);
+                if (object.table == nullptr)
+                {
+                    Py_DECREF(self);
+                    return nullptr;
+                }
+            }
+            return self;
+        }
+
+        PyObject* self = nullptr;  // borrowed: the C++ object lives inside it
+        std::shared_ptr<OverrideTable> table;  // null unless the object is an instance of a Python subclass
+    };
+
+    /// <summary>
+    /// Describes how to read the fields of a C++ record of type T from Python.
+    /// </summary>
+    template<typename T>
+    class FieldTable
+    {
+    public:
+        struct Field
+        {
+            /// <summary>
+            /// Reflect a data member; its type must have a Converter.
+            /// </summary>
+            template<typename M>
+            Field(const char* name, M T::* member)
+                : name(name)
+                , get([member](const T& record) { return Converter<M>::ToPython(record.*member); })
+            { }
+
+            /// <summary>
+            /// Reflect a computed value; get must return a new reference.
+            /// </summary>
+            Field(const char* name, std::function<PyObject*(const T&)> get)
+                : name(name)
+                , get(std::move(get))
+            { }
+
+            const char* name;
+            std::function<PyObject*(const T&)> get;
+        };
+
+        FieldTable(std::initializer_list<Field> fields)
+            : fields(fields)
+        { }
+
+        std::vector<Field> fields;
+    };
+
+    /// <summary>
+    /// Python sequence over a borrowed contiguous range of C++ records.
+    /// Items are lightweight record views whose attributes read the fields described by a FieldTable.
+    /// <para>Nothing is copied; the range must stay valid until Rebind or Detach is called, or the view is released.</para>
+    /// </summary>
+    template<typename T>
+    class SequenceView : public Object
+    {
+    public:
+        SequenceView(std::span<const T> items, const FieldTable<T>& table)
+            : Object(NativeType<View>::New(GetViewType(), items, table), false)
+        { }
+
+        /// <summary>
+        /// Point the view at a different range, for example after the container reallocated.
+        /// </summary>
+        void Rebind(std::span<const T> items) const
+        {
+            NativeType<View>::Get(ptr).items = items;
+        }
+
+        /// <summary>
+        /// Stop referencing the range; existing record views raise IndexError from then on.
+        /// </summary>
+        void Detach() const
+        {
+            Rebind({});
+        }
+
+        /// <summary>
+        /// Get the number of records in the view.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return NativeType<View>::Get(ptr).items.size();
+        }
+
+    private:
+        struct View
+        {
+            View(std::span<const T> items, const FieldTable<T>& table)
+                : items(items)
+                , fields(table.fields)
+            {
+                for (const auto& field : fields)
+                {
+                    PyObject* name = PyUnicode_InternFromString(field.name);
+                    if (name == nullptr)
+                        throw;
+                    names.emplace_back(name, false);
+                }
+            }
+
+            std::span<const T> items;
+            std::vector<typename FieldTable<T>::Field> fields;
+            std::vector<Object> names;  // interned
+        };
+
+        struct Record
+        {
+            Object view;
+            size_t index;
+        };
+
+        static PyTypeObject* GetViewType()
+        {
+            static PyTypeObject* type = NativeType<View>::Create("Py.SequenceView", {
+                { Py_sq_length, (void*)&ViewLength },
+                { Py_sq_item, (void*)&ViewItem },
+            });
+            return type;
+        }
+
+        static PyTypeObject* GetRecordType()
+        {
+            static PyTypeObject* type = NativeType<Record>::Create("Py.RecordView", {
+                { Py_tp_getattro, (void*)&RecordGetAttr },
+            });
+            return type;
+        }
+
+        static Py_ssize_t ViewLength(PyObject* self)
+        {
+            return NativeType<View>::Get(self).items.size();
+        }
+
+        static PyObject* ViewItem(PyObject* self, Py_ssize_t index)
+        {
+            if (index < 0 || (size_t)index >= NativeType<View>::Get(self).items.size())
+            {
+                PyErr_SetString(PyExc_IndexError, "SequenceView index out of range");
+                return nullptr;
+            }
+            return NativeType<Record>::New(GetRecordType(), Object(self), (size_t)index);
+        }
+
+        static PyObject* RecordGetAttr(PyObject* self, PyObject* name)
+        {
+            const Record& record = NativeType<Record>::Get(self);
+            const View& view = NativeType<View>::Get(record.view);
+            size_t i = 0;
+            // Attribute names are usually interned, so try identity before comparing contents.
+            while (i < view.names.size() && (PyObject*)view.names[i] != name)
+                ++i;
+            if (i == view.names.size() && PyUnicode_Check(name))
+            {
+                i = 0;
+                while (i < view.names.size() && PyUnicode_Compare(view.names[i], name) != 0)
+                    ++i;
+            }
+            if (i == view.names.size())
+                return PyObject_GenericGetAttr(self, name);
+            if (record.index >= view.items.size())
+            {
+                PyErr_SetString(PyExc_IndexError, "RecordView refers to a detached record");
+                return nullptr;
+            }
+            return view.fields[i].get(view.items[record.index]);
+        }
+    };
+
+    /// <summary>
+    /// Immutable-from-Python sequence of strings stored as Arrow-style offsets plus contiguous UTF-8 data.
+    /// Python str objects are only created when an element is accessed, optionally through a small cache.
+    /// <para>The 'data' and 'offsets' attributes expose the raw parts through the buffer protocol.</para>
+    /// <para>Append fails while any of those buffers is exported.</para>
+    /// </summary>
+    class StringArray : public Object
+    {
+    public:
+        StringArray(const Object& obj)
+            : Object(obj)
+        { }
+
+        StringArray(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Create an empty array.
+        /// </summary>
+        StringArray()
+            : Object(NativeType<Storage>::New(GetType(), size_t(0)), false)
+        { }
+
+        /// <summary>
+        /// Create an empty array with a cache of the str objects it creates.
+        /// </summary>
+        /// <param name="cache">Number of slots in the direct-mapped cache of created str objects; 0 disables it.</param>
+        static StringArray WithCache(size_t cache)
+        {
+            return StringArray(NativeType<Storage>::New(GetType(), cache), false);
+        }
+
+        /// <summary>
+        /// Create an array holding copies of the specified strings.
+        /// </summary>
+        StringArray(std::span<const std::string_view> strings, size_t cache = 0)
+            : Object(NativeType<Storage>::New(GetType(), cache), false)
+        {
+            size_t bytes = 0;
+            for (std::string_view s : strings)
+                bytes += s.size();
+            Reserve(strings.size(), bytes);
+            for (std::string_view s : strings)
+                Append(s);
+        }
+
+        /// <summary>
+        /// Reserve room for the specified number of additional strings and UTF-8 bytes.
+        /// Fails with BufferError if a buffer is exported, since growing would move the exported memory.
+        /// </summary>
+        bool Reserve(size_t count, size_t bytes) const
+        {
+            Storage& array = NativeType<Storage>::Get(ptr);
+            if (array.exports > 0)
+            {
+                PyErr_SetString(PyExc_BufferError, "cannot resize a StringArray while a buffer is exported");
+                return false;
+            }
+            array.offsets.reserve(array.offsets.size() + count);
+            array.data.reserve(array.data.size() + bytes);
+            return true;
+        }
+
+        /// <summary>
+        /// Append a UTF-8 string. It is validated when the element is accessed from Python.
+        /// Fails with BufferError if a buffer is exported.
+        /// </summary>
+        bool Append(std::string_view s) const
+        {
+            Storage& array = NativeType<Storage>::Get(ptr);
+            if (array.exports > 0)
+            {
+                PyErr_SetString(PyExc_BufferError, "cannot resize a StringArray while a buffer is exported");
+                return false;
+            }
+            array.data.append(s);
+            array.offsets.push_back(array.data.size());
+            return true;
+        }
+
+        /// <summary>
+        /// Get the number of strings in the array.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return NativeType<Storage>::Get(ptr).offsets.size() - 1;
+        }
+
+        /// <summary>
+        /// Get the UTF-8 bytes of the string at the specified position without creating a Python object.
+        /// </summary>
+        std::string_view GetView(size_t index) const
+        {
+            return NativeType<Storage>::Get(ptr).GetView(index);
+        }
+
+        std::string_view operator[](size_t index) const
+        {
+            return GetView(index);
+        }
+
+    private:
+        struct Storage
+        {
+            Storage(size_t cache)
+                : cache(cache)
+            { }
+
+            std::string_view GetView(size_t index) const
+            {
+                return { data.data() + offsets[index], (size_t)(offsets[index + 1] - offsets[index]) };
+            }
+
+            std::vector<int64_t> offsets { 0 };
+            std::string data;
+            std::vector<std::pair<size_t, Object>> cache;  // direct-mapped by index
+            Py_ssize_t exports = 0;
+        };
+
+        /// <summary>
+        /// Buffer exporter for one raw part of an array.
+        /// </summary>
+        struct Part
+        {
+            Object array;
+            bool offsets;
+            Py_ssize_t shape = 0;
+        };
+
+        static PyTypeObject* GetType()
+        {
+            static PyGetSetDef getset[] = {
+                { "data", (getter)&GetPart, nullptr, "UTF-8 bytes of all strings.", (void*)0 },
+                { "offsets", (getter)&GetPart, nullptr, "Start offset of each string in data, plus the end offset.", (void*)1 },
+                { }
+            };
+            static PyTypeObject* type = NativeType<Storage>::Create("Py.StringArray", {
+                { Py_sq_length, (void*)&Length },
+                { Py_sq_item, (void*)&Item },
+                { Py_tp_getset, (void*)getset },
+            });
+            return type;
+        }
+
+        static PyTypeObject* GetPartType()
+        {
+            static PyTypeObject* type = NativeType<Part>::Create("Py.StringArrayPart", {
+                { Py_bf_getbuffer, (void*)&GetBuffer },
+                { Py_bf_releasebuffer, (void*)&ReleaseBuffer },
+            });
+            return type;
+        }
+
+        static Py_ssize_t Length(PyObject* self)
+        {
+            return NativeType<Storage>::Get(self).offsets.size() - 1;
+        }
+
+        static PyObject* Item(PyObject* self, Py_ssize_t index)
+        {
+            Storage& array = NativeType<Storage>::Get(self);
+            if (index < 0 || (size_t)index >= array.offsets.size() - 1)
+            {
+                PyErr_SetString(PyExc_IndexError, "StringArray index out of range");
+                return nullptr;
+            }
+            std::pair<size_t, Object>* slot = nullptr;
+            if (!array.cache.empty())
+            {
+                slot = &array.cache[index % array.cache.size()];
+                if (slot->second && slot->first == (size_t)index)
+                    return Object(slot->second).AddRef();
+            }
+            std::string_view s = array.GetView(index);
+            PyObject* str = PyUnicode_DecodeUTF8(s.data(), s.size(), nullptr);
+            if (str != nullptr && slot != nullptr)
+            {
+                slot->first = index;
+                slot->second.SetObject(str);
+            }
+            return str;
+        }
+
+        static PyObject* GetPart(PyObject* self, void* offsets)
+        {
+            Object part(NativeType<Part>::New(GetPartType(), Object(self), offsets != nullptr), false);
+            return part ? PyMemoryView_FromObject(part) : nullptr;
+        }
+
+        static int GetBuffer(PyObject* self, Py_buffer* view, int flags)
+        {
+            Part& part = NativeType<Part>::Get(self);
+            Storage& array = NativeType<Storage>::Get(part.array);
+            int result = part.offsets
+                ? PyBuffer_FillInfo(view, self, array.offsets.data(), array.offsets.size() * sizeof(int64_t), 1, flags)
+                : PyBuffer_FillInfo(view, self, array.data.data(), array.data.size(), 1, flags);
+            if (result != 0)
+                return result;
+            if (part.offsets && (flags & PyBUF_FORMAT))
+            {
+                part.shape = array.offsets.size();
+                view->format = (char*)"q";
+                view->itemsize = sizeof(int64_t);
+                view->shape = (flags & PyBUF_ND) ? &part.shape : nullptr;
+            }
+            ++array.exports;
+            return 0;
+        }
+
+        static void ReleaseBuffer(PyObject* self, Py_buffer*)
+        {
+            --NativeType<Storage>::Get(NativeType<Part>::Get(self).array).exports;
+        }
+    };
+
+    /// <summary>
+    /// Growable contiguous array of numbers owned by C++, exposed to Python as a mutable sequence with the buffer protocol.
+    /// <para>Each element takes sizeof(T) bytes. Slicing from Python returns a memoryview of the array, not a copy.</para>
+    /// <para>Like bytearray, the array cannot change size while any buffer (including a slice view) is exported.</para>
+    /// </summary>
+    template<typename T>
+    class Array : public Object
+    {
+        static_assert(std::is_arithmetic_v<T> && sizeof(T) <= 8, "Array elements must be integers or floating point numbers of up to 64 bits");
+        static_assert(!std::is_same_v<T, bool>, "std::vector<bool> is not contiguous, use Array<uint8_t>");
+
+    public:
+        Array(const Object& obj)
+            : Object(obj)
+        { }
+
+        Array(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Create an empty array.
+        /// </summary>
+        Array()
+            : Object(NativeType<Storage>::New(GetType()), false)
+        { }
+
+        /// <summary>
+        /// Create an array holding a copy of the specified values.
+        /// </summary>
+        Array(std::span<const T> values)
+            : Array()
+        {
+            if (ptr != nullptr)
+                NativeType<Storage>::Get(ptr).values.assign(values.begin(), values.end());
+        }
+
+        /// <summary>
+        /// Get the elements. The span is invalidated when the array grows.
+        /// </summary>
+        std::span<T> GetSpan() const
+        {
+            return NativeType<Storage>::Get(ptr).values;
+        }
+
+        /// <summary>
+        /// Get the number of elements.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return NativeType<Storage>::Get(ptr).values.size();
+        }
+
+        /// <summary>
+        /// Reserve room for the specified number of elements in total.
+        /// </summary>
+        bool Reserve(size_t count) const
+        {
+            Storage& array = NativeType<Storage>::Get(ptr);
+            if (array.exports > 0)
+                return false;
+            array.values.reserve(count);
+            return true;
+        }
+
+        /// <summary>
+        /// Change the number of elements; new elements are zero. Fails if a buffer is exported.
+        /// </summary>
+        bool Resize(size_t count) const
+        {
+            Storage& array = NativeType<Storage>::Get(ptr);
+            if (array.exports > 0)
+                return false;
+            array.values.resize(count);
+            return true;
+        }
+
+        /// <summary>
+        /// Append a value. Fails if a buffer is exported.
+        /// </summary>
+        bool Append(T value) const
+        {
+            Storage& array = NativeType<Storage>::Get(ptr);
+            if (array.exports > 0)
+                return false;
+            array.values.push_back(value);
+            return true;
+        }
+
+        /// <summary>
+        /// Append copies of the specified values. Fails if a buffer is exported.
+        /// </summary>
+        bool Extend(std::span<const T> values) const
+        {
+            Storage& array = NativeType<Storage>::Get(ptr);
+            if (array.exports > 0)
+                return false;
+            array.values.insert(array.values.end(), values.begin(), values.end());
+            return true;
+        }
+
+        T& operator[](size_t index) const
+        {
+            return NativeType<Storage>::Get(ptr).values[index];
+        }
+
+    private:
+        struct Storage
+        {
+            std::vector<T> values;
+            Py_ssize_t exports = 0;
+            Py_ssize_t shape = 0;  // fixed while exported
+            Py_ssize_t stride = sizeof(T);
+        };
+
+        static constexpr char GetFormat()
+        {
+            if constexpr (std::is_floating_point_v<T>)
+                return sizeof(T) == 4 ? 'f' : 'd';
+            else
+            {
+                constexpr const char* codes = std::is_signed_v<T> ? "bhiq" : "BHIQ";
+                return codes[std::countr_zero(sizeof(T))];
+            }
+        }
+
+        static constexpr char format[2] = { GetFormat(), '\0' };
+
+        static PyTypeObject* GetType()
+        {
+            static PyMethodDef methods[] = {
+                { "append", (PyCFunction)(void*)&PyAppend, METH_O, "Append a value to the end of the array." },
+                { "extend", (PyCFunction)(void*)&PyExtend, METH_O, "Append the values of an iterable, or of a buffer with the same format." },
+                { "tolist", (PyCFunction)(void*)&PyToList, METH_NOARGS, "Return the values as a list." },
+                { }
+            };
+            static PyGetSetDef getset[] = {
+                { "typecode", (getter)&PyTypeCode, nullptr, "The struct format character of the elements.", nullptr },
+                { "itemsize", (getter)&PyItemSize, nullptr, "The size in bytes of one element.", nullptr },
+                { }
+            };
+            static PyTypeObject* type = NativeType<Storage>::Create("Py.Array", {
+                { Py_sq_length, (void*)&Length },
+                { Py_sq_item, (void*)&Item },
+                { Py_mp_length, (void*)&Length },
+                { Py_mp_subscript, (void*)&Subscript },
+                { Py_mp_ass_subscript, (void*)&AssignSubscript },
+                { Py_bf_getbuffer, (void*)&GetBuffer },
+                { Py_bf_releasebuffer, (void*)&ReleaseBuffer },
+                { Py_tp_methods, (void*)methods },
+                { Py_tp_getset, (void*)getset },
+                { Py_tp_repr, (void*)&Repr },
+            }, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_SEQUENCE);
+            return type;
+        }
+
+        /// <summary>
+        /// Convert a Python number to T, rejecting values that do not fit.
+        /// </summary>
+        static bool ToValue(PyObject* obj, T& value)
+        {
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                double number = PyFloat_AsDouble(obj);
+                value = (T)number;
+                return number != -1 || !PyErr_Occurred();
+            }
+            else
+            {
+                int overflow = 0;
+                long long number = PyLong_AsLongLongAndOverflow(obj, &overflow);
+                if (number == -1 && PyErr_Occurred())
+                    return false;
+                bool fits = overflow == 0 && (std::is_signed_v<T>
+                    ? number >= (long long)std::numeric_limits<T>::min() && number <= (long long)std::numeric_limits<T>::max()
+                    : number >= 0 && (unsigned long long)number <= std::numeric_limits<T>::max());
+                if constexpr (std::is_unsigned_v<T> && sizeof(T) == 8)
+                {
+                    if (overflow > 0)
+                    {
+                        unsigned long long large = PyLong_AsUnsignedLongLong(obj);
+                        if (large == (unsigned long long)-1 && PyErr_Occurred())
+                            return false;
+                        value = (T)large;
+                        return true;
+                    }
+                }
+                if (!fits)
+                {
+                    PyErr_Format(PyExc_OverflowError, "value out of range for array of type '%c'", format[0]);
+                    return false;
+                }
+                value = (T)number;
+                return true;
+            }
+        }
+
+        static bool CheckResize(Storage& array)
+        {
+            if (array.exports == 0)
+                return true;
+            PyErr_SetString(PyExc_BufferError, "Existing exports of data: object cannot be re-sized");
+            return false;
+        }
+
+        static bool GetIndex(Storage& array, Py_ssize_t& index)
+        {
+            if (index < 0)
+                index += array.values.size();
+            if (index >= 0 && (size_t)index < array.values.size())
+                return true;
+            PyErr_SetString(PyExc_IndexError, "array index out of range");
+            return false;
+        }
+
+        static Py_ssize_t Length(PyObject* self)
+        {
+            return NativeType<Storage>::Get(self).values.size();
+        }
+
+        static PyObject* Item(PyObject* self, Py_ssize_t index)
+        {
+            Storage& array = NativeType<Storage>::Get(self);
+            if (index < 0 || (size_t)index >= array.values.size())
+            {
+                PyErr_SetString(PyExc_IndexError, "array index out of range");
+                return nullptr;
+            }
+            return Converter<T>::ToPython(array.values[index]);
+        }
+
+        static PyObject* Subscript(PyObject* self, PyObject* key)
+        {
+            if (PySlice_Check(key))
+            {
+                Object view = Py_ObjWrap(PyMemoryView_FromObject(self));
+                return view ? PyObject_GetItem(view, key) : nullptr;
+            }
+            Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+            if (index == -1 && PyErr_Occurred())
+                return nullptr;
+            Storage& array = NativeType<Storage>::Get(self);
+            return GetIndex(array, index) ? Converter<T>::ToPython(array.values[index]) : nullptr;
+        }
+
+        static int AssignSubscript(PyObject* self, PyObject* key, PyObject* value)
+        {
+            if (value == nullptr)
+            {
+                PyErr_SetString(PyExc_TypeError, "array elements cannot be deleted");
+                return -1;
+            }
+            if (PySlice_Check(key))
+            {
+                Object view = Py_ObjWrap(PyMemoryView_FromObject(self));
+                return view ? PyObject_SetItem(view, key, value) : -1;
+            }
+            Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+            if (index == -1 && PyErr_Occurred())
+                return -1;
+            Storage& array = NativeType<Storage>::Get(self);
+            T number;
+            if (!GetIndex(array, index) || !ToValue(value, number))
+                return -1;
+            array.values[index] = number;
+            return 0;
+        }
+
+        static PyObject* PyAppend(PyObject* self, PyObject* value)
+        {
+            Storage& array = NativeType<Storage>::Get(self);
+            T number;
+            if (!ToValue(value, number) || !CheckResize(array))
+                return nullptr;
+            array.values.push_back(number);
+            Py_RETURN_NONE;
+        }
+
+        static PyObject* PyExtend(PyObject* self, PyObject* iterable)
+        {
+            Storage& array = NativeType<Storage>::Get(self);
+            std::vector<T> values;
+            if (iterable == self)
+                values = array.values;
+            else if (PyObject_CheckBuffer(iterable))
+            {
+                Py_buffer view;
+                if (PyObject_GetBuffer(iterable, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == 0)
+                {
+                    // Copy same-typed buffers directly, e.g. another Array, array.array or a NumPy array.
+                    bool same = view.itemsize == sizeof(T) && view.format != nullptr
+                        && std::strcmp(view.format[0] == '@' || view.format[0] == '=' ? view.format + 1 : view.format, format) == 0;
+                    if (same)
+                        values.assign((const T*)view.buf, (const T*)view.buf + view.len / sizeof(T));
+                    PyBuffer_Release(&view);
+                    if (same)
+                        iterable = nullptr;
+                }
+                else
+                    PyErr_Clear();
+            }
+            if (iterable != nullptr && iterable != self)
+            {
+                Object it = Py_ObjWrap(PyObject_GetIter(iterable));
+                if (!it)
+                    return nullptr;
+                Py_ssize_t hint = PyObject_LengthHint(iterable, 0);
+                if (hint > 0)
+                    values.reserve(hint);
+                while (PyObject* item = PyIter_Next(it))
+                {
+                    T number;
+                    bool converted = ToValue(item, number);
+                    Py_DECREF(item);
+                    if (!converted)
+                        return nullptr;
+                    values.push_back(number);
+                }
+                if (PyErr_Occurred())
+                    return nullptr;
+            }
+            if (!CheckResize(array))
+                return nullptr;
+            array.values.insert(array.values.end(), values.begin(), values.end());
+            Py_RETURN_NONE;
+        }
+
+        static PyObject* PyToList(PyObject* self, PyObject*)
+        {
+            const std::vector<T>& values = NativeType<Storage>::Get(self).values;
+            Object list = Py_ObjWrap(PyList_New(values.size()));
+            for (size_t i = 0; list && i < values.size(); ++i)
+            {
+                PyObject* item = Converter<T>::ToPython(values[i]);
+                if (item == nullptr)
+                    return nullptr;
+                PyList_SET_ITEM((PyObject*)list, i, item);
+            }
+            return list.AddRef();
+        }
+
+        static PyObject* PyTypeCode(PyObject*, void*)
+        {
+            return PyUnicode_FromStringAndSize(format, 1);
+        }
+
+        static PyObject* PyItemSize(PyObject*, void*)
+        {
+            return PyLong_FromSize_t(sizeof(T));
+        }
+
+        static PyObject* Repr(PyObject* self)
+        {
+            Object list = Py_ObjWrap(PyToList(self, nullptr));
+            return list ? PyUnicode_FromFormat("Py.Array('%s', %R)", format, (PyObject*)list) : nullptr;
+        }
+
+        static int GetBuffer(PyObject* self, Py_buffer* view, int flags)
+        {
+            Storage& array = NativeType<Storage>::Get(self);
+            if (PyBuffer_FillInfo(view, self, array.values.data(), array.values.size() * sizeof(T), 0, flags) != 0)
+                return -1;
+            array.shape = array.values.size();
+            view->itemsize = sizeof(T);
+            view->format = (flags & PyBUF_FORMAT) ? (char*)format : nullptr;
+            view->shape = (flags & PyBUF_ND) ? &array.shape : nullptr;
+            view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &array.stride : nullptr;
+            ++array.exports;
+            return 0;
+        }
+
+        static void ReleaseBuffer(PyObject* self, Py_buffer*)
+        {
+            --NativeType<Storage>::Get(self).exports;
+        }
+    };
+
+    /// <summary>
+    /// Prepared batch of strings for bulk creation of Python str objects.
+    /// The constructor validates UTF-8, finds each string's widest code point and re-encodes it in CPython's
+    /// canonical 1, 2 or 4 byte form; it does not need the GIL and independent chunks can be analyzed in parallel.
+    /// <para>ToList only allocates the objects and copies the prepared bytes, so the GIL is held briefly.</para>
+    /// </summary>
+    class StrPlan
+    {
+    public:
+        /// <summary>
+        /// Analyze a batch of UTF-8 strings. Does not require the GIL.
+        /// </summary>
+        /// <param name="replace">If true, invalid sequences are replaced with U+FFFD; otherwise the plan is marked invalid.</param>
+        StrPlan(std::span<const std::string_view> strings, bool replace = false)
+        {
+            entries.reserve(strings.size());
+            std::u32string decoded;
+            for (std::string_view s : strings)
+            {
+                Entry entry { buffer.size(), 0, 0 };
+                if (std::all_of(s.begin(), s.end(), [](char c) { return (unsigned char)c < 0x80; }))
+                {
+                    entry.length = s.size();
+                    entry.maxchar = s.empty() ? 0 : 0x7F;
+                    buffer.append(s);
+                }
+                else
+                {
+                    if (!Decode(s, decoded, replace) && error == SIZE_MAX)
+                        error = entries.size();
+                    entry.length = decoded.size();
+                    entry.maxchar = decoded.empty() ? 0 : *std::max_element(decoded.begin(), decoded.end());
+                    if (entry.maxchar < 0x100)
+                        Append<uint8_t>(decoded);
+                    else if (entry.maxchar < 0x10000)
+                        Append<uint16_t>(decoded);
+                    else
+                        Append<uint32_t>(decoded);
+                }
+                entries.push_back(entry);
+            }
+        }
+
+        /// <summary>
+        /// Analyze a batch on several threads, one plan per chunk. Does not require the GIL.
+        /// </summary>
+        static std::vector<StrPlan> AnalyzeParallel(std::span<const std::string_view> strings, size_t threads, bool replace = false)
+        {
+            threads = std::max<size_t>(1, std::min(threads, strings.size()));
+            size_t chunk = (strings.size() + threads - 1) / threads;
+            std::vector<std::optional<StrPlan>> results(threads);
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < threads; i++)
+                workers.emplace_back([&, i] {
+                    size_t begin = std::min(i * chunk, strings.size());
+                    results[i].emplace(strings.subspan(begin, std::min(chunk, strings.size() - begin)), replace);
+                });
+            for (std::thread& worker : workers)
+                worker.join();
+            std::vector<StrPlan> plans;
+            for (std::optional<StrPlan>& result : results)
+                plans.push_back(std::move(*result));
+            return plans;
+        }
+
+        /// <summary>
+        /// Determine if every string was valid UTF-8, or was repaired.
+        /// </summary>
+        bool IsValid() const
+        {
+            return error == SIZE_MAX;
+        }
+
+        /// <summary>
+        /// Get the number of strings in the plan.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return entries.size();
+        }
+
+        /// <summary>
+        /// Create the str object for the string at the specified position.
+        /// Fails with UnicodeError for the first invalid string and every string after it, as ToList does for the whole plan.
+        /// </summary>
+        Str GetStr(size_t index) const
+        {
+            if (index >= error)
+            {
+                PyErr_Format(PyExc_UnicodeError, "invalid UTF-8 in string %zu", error);
+                return Py_ObjWrap(nullptr);
+            }
+            return Py_ObjWrap(New(entries[index]));
+        }
+
+        /// <summary>
+        /// Create a list with the str objects of this plan.
+        /// Fails with UnicodeError if the plan is not valid.
+        /// </summary>
+        List ToList() const
+        {
+            return ToList({ this, 1 });
+        }
+
+        /// <summary>
+        /// Create a list with the str objects of several plans, in order.
+        /// </summary>
+        static List ToList(std::span<const StrPlan> plans)
+        {
+            size_t n = 0;
+            for (const StrPlan& plan : plans)
+            {
+                if (!plan.IsValid())
+                {
+                    PyErr_Format(PyExc_UnicodeError, "invalid UTF-8 in string %zu", n + plan.error);
+                    return { nullptr, false };
+                }
+                n += plan.entries.size();
+            }
+            List list = List::FromSize(n);
+            if (!list)
+                return list;
+            size_t i = 0;
+            for (const StrPlan& plan : plans)
+            {
+                for (const Entry& entry : plan.entries)
+                {
+                    PyObject* str = plan.New(entry);
+                    if (str == nullptr)
+                        return { nullptr, false };
+                    PyList_SET_ITEM((PyObject*)list, i++, str);
+                }
+            }
+            return list;
+        }
+
+    private:
+        struct Entry
+        {
+            size_t offset;
+            size_t length;  // in code points
+            char32_t maxchar;
+        };
+
+        PyObject* New(const Entry& entry) const
+        {
+            PyObject* str = PyUnicode_New(entry.length, entry.maxchar);
+            if (str != nullptr)
+                std::memcpy(PyUnicode_DATA(str), buffer.data() + entry.offset, entry.length * PyUnicode_KIND(str));
+            return str;
+        }
+
+        template<typename Char>
+        void Append(const std::u32string& decoded)
+        {
+            size_t offset = buffer.size();
+            buffer.resize(offset + decoded.size() * sizeof(Char));
+            char* out = buffer.data() + offset;
+            for (size_t i = 0; i < decoded.size(); i++)
+            {
+                Char c = (Char)decoded[i];
+                std::memcpy(out + i * sizeof(Char), &c, sizeof(Char));  // the buffer is not aligned for Char
+            }
+        }
+
+        /// <summary>
+        /// Strict UTF-8 decoding, rejecting overlong forms and surrogates like CPython does.
+        /// </summary>
+        static bool Decode(std::string_view s, std::u32string& out, bool replace)
+        {
+            bool valid = true;
+            out.clear();
+            for (size_t i = 0; i < s.size();)
+            {
+                unsigned char c = s[i];
+                size_t n = c < 0x80 ? 1 : c >= 0xC2 && c < 0xE0 ? 2 : c >= 0xE0 && c < 0xF0 ? 3 : c >= 0xF0 && c < 0xF5 ? 4 : 0;
+                char32_t cp = n == 1 ? c : n == 2 ? c & 0x1F : n == 3 ? c & 0x0F : c & 0x07;
+                size_t j = 1;
+                for (; j < n && i + j < s.size() && ((unsigned char)s[i + j] & 0xC0) == 0x80; j++)
+                    cp = (cp << 6) | ((unsigned char)s[i + j] & 0x3F);
+                bool ok = n != 0 && j == n
+                    && !(n == 3 && (cp < 0x800 || (cp >= 0xD800 && cp < 0xE000)))
+                    && !(n == 4 && (cp < 0x10000 || cp > 0x10FFFF));
+                if (!ok)
+                {
+                    valid = false;
+                    if (!replace)
+                        return false;
+                    out.push_back(0xFFFD);
+                    i += std::max<size_t>(1, j);
+                    continue;
+                }
+                out.push_back(cp);
+                i += n;
+            }
+            return valid || replace;
+        }
+
+        std::vector<Entry> entries;
+        std::string buffer;  // strings in their canonical representation
+        size_t error = SIZE_MAX;
+    };
+
+    /// <summary>
+    /// Immutable mapping stored as a hash array mapped trie, exposed to Python as a collections.abc.Mapping.
+    /// <para>Set and Delete return a new map in O(log n) that shares all untouched nodes with the original, so a snapshot
+    /// is just another reference to the same object. Keys must be hashable; lookups use Python hashing and equality.</para>
+    /// </summary>
+    class Map : public Object
+    {
+    public:
+        /// <summary>
+        /// Create an empty map.
+        /// </summary>
+        Map()
+            : Object(NativeType<State>::New(GetType()), false)
+        { }
+
+        Map(const Object& obj)
+            : Object(obj)
+        { }
+
+        Map(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Create a map with the items of a dictionary.
+        /// </summary>
+        static Map FromDict(const Dict& dict)
+        {
+            Map map;
+            Py_ssize_t pos = 0;
+            PyObject* key;
+            PyObject* value;
+            while (map && PyDict_Next(dict, &pos, &key, &value))
+                map.SetObject(map.Set(Object(key), Object(value)));
+            return map;
+        }
+
+        /// <summary>
+        /// Get the number of items.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return NativeType<State>::Get(ptr).size;
+        }
+
+        /// <summary>
+        /// Get the value for a key, or null if it is not present. Null with an exception set if hashing or comparing failed.
+        /// </summary>
+        Object Get(const Object& key) const
+        {
+            Py_hash_t hash = PyObject_Hash(key);
+            if (hash == -1)
+                return { };
+            return Object(Find(NativeType<State>::Get(ptr).root.get(), 0, hash, key));
+        }
+
+        /// <summary>
+        /// Get a new version of the map where key maps to value.
+        /// </summary>
+        Map Set(const Object& key, const Object& value) const
+        {
+            return Py_ObjWrap(PySetItem(ptr, key, value));
+        }
+
+        /// <summary>
+        /// Get a new version of the map without key. The same map is returned if the key is not present.
+        /// </summary>
+        Map Delete(const Object& key) const
+        {
+            return Py_ObjWrap(PyDeleteItem(ptr, key, false));
+        }
+
+        /// <summary>
+        /// Copy the items into a new dictionary.
+        /// </summary>
+        Dict ToDict() const
+        {
+            return Py_ObjWrap(PyToDict(ptr, nullptr));
+        }
+
+    private:
+        struct Node;
+        using NodePtr = std::shared_ptr<const Node>;
+
+        struct Entry
+        {
+            Entry(uint64_t hash, PyObject* key, PyObject* value)
+                : hash(hash)
+                , key(Py_NewRef(key))
+                , value(Py_NewRef(value))
+            { }
+
+            Entry(NodePtr child)
+                : child(std::move(child))
+            { }
+
+            Entry(const Entry& other)
+                : hash(other.hash)
+                , key(Py_XNewRef(other.key))
+                , value(Py_XNewRef(other.value))
+                , child(other.child)
+            { }
+
+            Entry(Entry&& other) noexcept
+                : hash(other.hash)
+                , key(std::exchange(other.key, nullptr))
+                , value(std::exchange(other.value, nullptr))
+                , child(std::move(other.child))
+            { }
+
+            Entry& operator=(Entry other) noexcept
+            {
+                std::swap(hash, other.hash);
+                std::swap(key, other.key);
+                std::swap(value, other.value);
+                std::swap(child, other.child);
+                return *this;
+            }
+
+            ~Entry()
+            {
+                // Nodes are only released while holding the GIL.
+                Py_XDECREF(key);
+                Py_XDECREF(value);
+            }
+
+            uint64_t hash = 0;
+            PyObject* key = nullptr;  // null for a child entry
+            PyObject* value = nullptr;
+            NodePtr child;
+        };
+
+        // A bitmap node indexes up to 32 entries by 5 bits of the hash at its depth.
+        // A collision node holds leaves whose full hashes are equal.
+        struct Node
+        {
+            uint32_t bitmap = 0;
+            bool collision = false;
+            std::vector<Entry> entries;
+        };
+
+        struct State
+        {
+            NodePtr root;
+            size_t size = 0;
+        };
+
+        static constexpr unsigned Bits = 5;
+
+        static uint32_t GetBit(uint64_t hash, unsigned shift)
+        {
+            return 1u << ((hash >> shift) & 31);
+        }
+
+        static size_t GetIndex(uint32_t bitmap, uint32_t bit)
+        {
+            return std::popcount(bitmap & (bit - 1));
+        }
+
+        /// <summary>
+        /// Compare keys; -1 with an exception set on error.
+        /// </summary>
+        static int Equal(PyObject* a, PyObject* b)
+        {
+            return a == b ? 1 : PyObject_RichCompareBool(a, b, Py_EQ);
+        }
+
+        /// <summary>
+        /// Get a borrowed reference to the value for a key, or nullptr (check PyErr_Occurred).
+        /// </summary>
+        static PyObject* Find(const Node* node, unsigned shift, uint64_t hash, PyObject* key)
+        {
+            while (node != nullptr)
+            {
+                if (node->collision)
+                {
+                    for (const Entry& entry : node->entries)
+                    {
+                        int equal = entry.hash == hash ? Equal(entry.key, key) : 0;
+                        if (equal != 0)
+                            return equal > 0 ? entry.value : nullptr;
+                    }
+                    return nullptr;
+                }
+                uint32_t bit = GetBit(hash, shift);
+                if ((node->bitmap & bit) == 0)
+                    return nullptr;
+                const Entry& entry = node->entries[GetIndex(node->bitmap, bit)];
+                if (entry.key == nullptr)
+                {
+                    node = entry.child.get();
+                    shift += Bits;
+                    continue;
+                }
+                int equal = entry.hash == hash ? Equal(entry.key, key) : 0;
+                return equal > 0 ? entry.value : nullptr;
+            }
+            return nullptr;
+        }
+
+        /// <summary>
+        /// Build the smallest subtree holding two leaves with different keys.
+        /// </summary>
+        static NodePtr Merge(unsigned shift, Entry first, Entry second)
+        {
+            auto node = std::make_shared<Node>();
+            if (first.hash == second.hash)
+            {
+                node->collision = true;
+                node->entries.push_back(std::move(first));
+                node->entries.push_back(std::move(second));
+                return node;
+            }
+            uint32_t a = GetBit(first.hash, shift);
+            uint32_t b = GetBit(second.hash, shift);
+            node->bitmap = a | b;
+            if (a == b)
+                node->entries.emplace_back(Merge(shift + Bits, std::move(first), std::move(second)));
+            else if (a < b)
+            {
+                node->entries.push_back(std::move(first));
+                node->entries.push_back(std::move(second));
+            }
+            else
+            {
+                node->entries.push_back(std::move(second));
+                node->entries.push_back(std::move(first));
+            }
+            return node;
+        }
+
+        /// <summary>
+        /// Get a copy of the path to key with the value replaced or inserted. The same node is returned if nothing changed.
+        /// </summary>
+        static bool Assoc(const NodePtr& node, unsigned shift, uint64_t hash, PyObject* key, PyObject* value, NodePtr& result, bool& added)
+        {
+            if (node == nullptr)
+            {
+                auto leaf = std::make_shared<Node>();
+                leaf->bitmap = GetBit(hash, shift);
+                leaf->entries.emplace_back(hash, key, value);
+                added = true;
+                result = std::move(leaf);
+                return true;
+            }
+            if (node->collision)
+            {
+                if (node->entries[0].hash != hash)
+                {
+                    // Push the collision node one level down, next to the new leaf.
+                    auto parent = std::make_shared<Node>();
+                    parent->bitmap = GetBit(node->entries[0].hash, shift);
+                    parent->entries.emplace_back(node);
+                    return Assoc(parent, shift, hash, key, value, result, added);
+                }
+                auto copy = std::make_shared<Node>(*node);
+                for (Entry& entry : copy->entries)
+                {
+                    int equal = Equal(entry.key, key);
+                    if (equal < 0)
+                        return false;
+                    if (equal > 0)
+                    {
+                        if (entry.value == value)
+                            result = node;
+                        else
+                        {
+                            entry = Entry(hash, entry.key, value);
+                            result = std::move(copy);
+                        }
+                        return true;
+                    }
+                }
+                copy->entries.emplace_back(hash, key, value);
+                added = true;
+                result = std::move(copy);
+                return true;
+            }
+            uint32_t bit = GetBit(hash, shift);
+            size_t index = GetIndex(node->bitmap, bit);
+            if ((node->bitmap & bit) == 0)
+            {
+                auto copy = std::make_shared<Node>();
+                copy->bitmap = node->bitmap | bit;
+                copy->entries.reserve(node->entries.size() + 1);
+                copy->entries.insert(copy->entries.end(), node->entries.begin(), node->entries.begin() + index);
+                copy->entries.emplace_back(hash, key, value);
+                copy->entries.insert(copy->entries.end(), node->entries.begin() + index, node->entries.end());
+                added = true;
+                result = std::move(copy);
+                return true;
+            }
+            const Entry& entry = node->entries[index];
+            Entry replacement(nullptr);
+            if (entry.key == nullptr)
+            {
+                NodePtr child;
+                if (!Assoc(entry.child, shift + Bits, hash, key, value, child, added))
+                    return false;
+                if (child == entry.child)
+                {
+                    result = node;
+                    return true;
+                }
+                replacement = Entry(std::move(child));
+            }
+            else
+            {
+                int equal = entry.hash == hash ? Equal(entry.key, key) : 0;
+                if (equal < 0)
+                    return false;
+                if (equal > 0 && entry.value == value)
+                {
+                    result = node;
+                    return true;
+                }
+                if (equal > 0)
+                    replacement = Entry(hash, entry.key, value);
+                else
+                {
+                    replacement = Entry(Merge(shift + Bits, entry, Entry(hash, key, value)));
+                    added = true;
+                }
+            }
+            auto copy = std::make_shared<Node>(*node);
+            copy->entries[index] = std::move(replacement);
+            result = std::move(copy);
+            return true;
+        }
+
+        /// <summary>
+        /// Get a copy of the path to key with the key removed; null if the node became empty.
+        /// The same node is returned if the key is not present.
+        /// </summary>
+        static bool Without(const NodePtr& node, unsigned shift, uint64_t hash, PyObject* key, NodePtr& result)
+        {
+            result = node;
+            if (node == nullptr)
+                return true;
+            size_t index = 0;
+            if (node->collision)
+            {
+                while (index < node->entries.size())
+                {
+                    int equal = node->entries[index].hash == hash ? Equal(node->entries[index].key, key) : 0;
+                    if (equal < 0)
+                        return false;
+                    if (equal > 0)
+                        break;
+                    ++index;
+                }
+                if (index == node->entries.size())
+                    return true;
+                auto copy = std::make_shared<Node>();
+                if (node->entries.size() == 2)
+                {
+                    // A single leaf is stored as a regular bitmap node.
+                    const Entry& other = node->entries[1 - index];
+                    copy->bitmap = GetBit(other.hash, shift);
+                    copy->entries.push_back(other);
+                }
+                else
+                {
+                    copy->collision = true;
+                    copy->entries = node->entries;
+                    copy->entries.erase(copy->entries.begin() + index);
+                }
+                result = std::move(copy);
+                return true;
+            }
+            uint32_t bit = GetBit(hash, shift);
+            if ((node->bitmap & bit) == 0)
+                return true;
+            index = GetIndex(node->bitmap, bit);
+            const Entry& entry = node->entries[index];
+            std::optional<Entry> replacement;
+            if (entry.key == nullptr)
+            {
+                NodePtr child;
+                if (!Without(entry.child, shift + Bits, hash, key, child))
+                    return false;
+                if (child == entry.child)
+                    return true;
+                // Pull a lone leaf up so the trie stays as shallow as possible.
+                if (child != nullptr && !child->collision && child->entries.size() == 1 && child->entries[0].key != nullptr)
+                    replacement.emplace(child->entries[0]);
+                else if (child != nullptr)
+                    replacement.emplace(std::move(child));
+            }
+            else
+            {
+                int equal = entry.hash == hash ? Equal(entry.key, key) : 0;
+                if (equal < 0)
+                    return false;
+                if (equal == 0)
+                    return true;
+            }
+            if (replacement)
+            {
+                auto copy = std::make_shared<Node>(*node);
+                copy->entries[index] = std::move(*replacement);
+                result = std::move(copy);
+                return true;
+            }
+            if (node->entries.size() == 1)
+            {
+                result = nullptr;
+                return true;
+            }
+            auto copy = std::make_shared<Node>();
+            copy->bitmap = node->bitmap & ~bit;
+            copy->entries.reserve(node->entries.size() - 1);
+            for (size_t i = 0; i < node->entries.size(); ++i)
+                if (i != index)
+                    copy->entries.push_back(node->entries[i]);
+            result = std::move(copy);
+            return true;
+        }
+
+        /// <summary>
+        /// Depth-first walk over the leaves of a trie.
+        /// </summary>
+        struct Cursor
+        {
+            Cursor(const Node* root)
+            {
+                if (root != nullptr)
+                    stack.push_back({ root, 0 });
+            }
+
+            const Entry* Next()
+            {
+                while (!stack.empty())
+                {
+                    auto& [node, index] = stack.back();
+                    if (index == node->entries.size())
+                    {
+                        stack.pop_back();
+                        continue;
+                    }
+                    const Entry& entry = node->entries[index++];
+                    if (entry.key != nullptr)
+                        return &entry;
+                    stack.push_back({ entry.child.get(), 0 });
+                }
+                return nullptr;
+            }
+
+            std::vector<std::pair<const Node*, size_t>> stack;
+        };
+
+        struct Iterator
+        {
+            Iterator(const Object& map)
+                : map(map)
+                , cursor(NativeType<State>::Get(map).root.get())
+            { }
+
+            Object map;  // keeps the nodes alive
+            Cursor cursor;
+        };
+
+        static PyTypeObject* GetType()
+        {
+            static PyMethodDef methods[] = {
+                { "get", (PyCFunction)(void*)&PyGet, METH_FASTCALL, "get(key, default=None, /)\n--\n\nReturn the value for key if key is in the map, else default." },
+                { "keys", (PyCFunction)(void*)&PyKeys, METH_NOARGS, "Return a set-like view of the keys." },
+                { "values", (PyCFunction)(void*)&PyValues, METH_NOARGS, "Return a view of the values." },
+                { "items", (PyCFunction)(void*)&PyItems, METH_NOARGS, "Return a set-like view of the items." },
+                { "set", (PyCFunction)(void*)&PySet, METH_FASTCALL, "set(key, value, /)\n--\n\nReturn a new map where key maps to value." },
+                { "delete", (PyCFunction)(void*)&PyDelete, METH_O, "delete(key, /)\n--\n\nReturn a new map without key. Raise KeyError if key is not present." },
+                { "to_dict", (PyCFunction)(void*)&PyToDict, METH_NOARGS, "Return the items as a new dict." },
+                { }
+            };
+            static PyTypeObject* type = CreateType(methods);
+            return type;
+        }
+
+        static PyTypeObject* CreateType(PyMethodDef* methods)
+        {
+            PyTypeObject* type = NativeType<State>::Create("Py.Map", {
+                { Py_mp_length, (void*)&PyLength },
+                { Py_mp_subscript, (void*)&PySubscript },
+                { Py_sq_contains, (void*)&PyContains },
+                { Py_tp_iter, (void*)&PyIter },
+                { Py_tp_richcompare, (void*)&PyCompare },
+                { Py_tp_repr, (void*)&PyRepr },
+                { Py_tp_methods, (void*)methods },
+                { Py_tp_traverse, (void*)&Traverse },
+                { Py_tp_clear, (void*)&ClearSlot },
+            }, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_MAPPING | Py_TPFLAGS_HAVE_GC);
+            if (type == nullptr)
+                return nullptr;
+            // Makes isinstance(map, collections.abc.Mapping) true.
+            Module abc(Str("collections.abc"));
+            if (!abc || !Callable(abc.GetAttr("Mapping").GetAttr("register")).Call(Object((PyObject*)type)))
+                PyErr_Clear();
+            return type;
+        }
+
+        /// <summary>
+        /// Visit the keys and values this map owns alone. Nodes are shared between versions, and a reference held by a
+        /// shared node must not be visited once per version, so subtrees with other owners are skipped; objects reachable
+        /// only through them look externally referenced, which keeps them alive.
+        /// </summary>
+        static int Visit(const NodePtr& node, visitproc visit, void* arg)
+        {
+            if (node == nullptr || node.use_count() != 1)
+                return 0;
+            for (const Entry& entry : node->entries)
+            {
+                if (entry.key == nullptr)
+                {
+                    if (int result = Visit(entry.child, visit, arg))
+                        return result;
+                    continue;
+                }
+                Py_VISIT(entry.key);
+                Py_VISIT(entry.value);
+            }
+            return 0;
+        }
+
+        static int Traverse(PyObject* self, visitproc visit, void* arg)
+        {
+            Py_VISIT(Py_TYPE(self));
+            return Visit(NativeType<State>::Get(self).root, visit, arg);
+        }
+
+        static int ClearSlot(PyObject* self)
+        {
+            State& state = NativeType<State>::Get(self);
+            NodePtr root = std::move(state.root);
+            state.size = 0;
+            root = nullptr;  // may run arbitrary code, so the map is emptied first
+            return 0;
+        }
+
+        static PyTypeObject* GetIteratorType()
+        {
+            static PyTypeObject* type = NativeType<Iterator>::Create("Py.MapIterator", {
+                { Py_tp_iter, (void*)&PyObject_SelfIter },
+                { Py_tp_iternext, (void*)&PyNext },
+            });
+            return type;
+        }
+
+        static PyObject* NewVersion(NodePtr root, size_t size)
+        {
+            PyObject* map = NativeType<State>::New(GetType());
+            if (map != nullptr)
+            {
+                NativeType<State>::Get(map).root = std::move(root);
+                NativeType<State>::Get(map).size = size;
+            }
+            return map;
+        }
+
+        static PyObject* PySetItem(PyObject* self, PyObject* key, PyObject* value)
+        {
+            const State& state = NativeType<State>::Get(self);
+            Py_hash_t hash = PyObject_Hash(key);
+            NodePtr root;
+            bool added = false;
+            if (hash == -1 || !Assoc(state.root, 0, hash, key, value, root, added))
+                return nullptr;
+            if (root == state.root)
+                return Py_NewRef(self);
+            return NewVersion(std::move(root), state.size + added);
+        }
+
+        static PyObject* PyDeleteItem(PyObject* self, PyObject* key, bool required)
+        {
+            const State& state = NativeType<State>::Get(self);
+            Py_hash_t hash = PyObject_Hash(key);
+            NodePtr root;
+            if (hash == -1 || !Without(state.root, 0, hash, key, root))
+                return nullptr;
+            if (root == state.root)
+            {
+                if (required)
+                {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                    return nullptr;
+                }
+                return Py_NewRef(self);
+            }
+            return NewVersion(std::move(root), state.size - 1);
+        }
+
+        static PyObject* PyLookup(PyObject* self, PyObject* key)
+        {
+            Py_hash_t hash = PyObject_Hash(key);
+            return hash == -1 ? nullptr : Find(NativeType<State>::Get(self).root.get(), 0, hash, key);
+        }
+
+        static Py_ssize_t PyLength(PyObject* self)
+        {
+            return NativeType<State>::Get(self).size;
+        }
+
+        static PyObject* PySubscript(PyObject* self, PyObject* key)
+        {
+            PyObject* value = PyLookup(self, key);
+            if (value == nullptr && !PyErr_Occurred())
+                PyErr_SetObject(PyExc_KeyError, key);
+            return Py_XNewRef(value);
+        }
+
+        static int PyContains(PyObject* self, PyObject* key)
+        {
+            PyObject* value = PyLookup(self, key);
+            return value != nullptr ? 1 : PyErr_Occurred() ? -1 : 0;
+        }
+
+        static PyObject* PyGet(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+        {
+            if (nargs < 1 || nargs > 2)
+            {
+                PyErr_Format(PyExc_TypeError, "get expected 1 or 2 arguments, got %zd", nargs);
+                return nullptr;
+            }
+            PyObject* value = PyLookup(self, args[0]);
+            if (value == nullptr && PyErr_Occurred())
+                return nullptr;
+            return Py_NewRef(value ? value : nargs == 2 ? args[1] : Py_None);
+        }
+
+        static PyObject* PySet(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+        {
+            if (nargs != 2)
+            {
+                PyErr_Format(PyExc_TypeError, "set expected 2 arguments, got %zd", nargs);
+                return nullptr;
+            }
+            return PySetItem(self, args[0], args[1]);
+        }
+
+        static PyObject* PyDelete(PyObject* self, PyObject* key)
+        {
+            return PyDeleteItem(self, key, true);
+        }
+
+        static PyObject* GetView(PyObject* self, const char* name)
+        {
+            Module abc(Str("collections.abc"));
+            return abc ? Callable(abc.GetAttr(name)).Call(Object(self)).AddRef() : nullptr;
+        }
+
+        static PyObject* PyKeys(PyObject* self, PyObject*)
+        {
+            return GetView(self, "KeysView");
+        }
+
+        static PyObject* PyValues(PyObject* self, PyObject*)
+        {
+            return GetView(self, "ValuesView");
+        }
+
+        static PyObject* PyItems(PyObject* self, PyObject*)
+        {
+            return GetView(self, "ItemsView");
+        }
+
+        static PyObject* PyToDict(PyObject* self, PyObject*)
+        {
+            Object dict = Py_ObjWrap(PyDict_New());
+            Cursor cursor(NativeType<State>::Get(self).root.get());
+            while (dict)
+            {
+                const Entry* entry = cursor.Next();
+                if (entry == nullptr)
+                    return dict.AddRef();
+                if (PyDict_SetItem(dict, entry->key, entry->value) != 0)
+                    return nullptr;
+            }
+            return nullptr;
+        }
+
+        static PyObject* PyIter(PyObject* self)
+        {
+            return NativeType<Iterator>::New(GetIteratorType(), Object(self));
+        }
+
+        static PyObject* PyNext(PyObject* self)
+        {
+            const Entry* entry = NativeType<Iterator>::Get(self).cursor.Next();
+            return entry ? Py_NewRef(entry->key) : nullptr;
+        }
+
+        /// <summary>
+        /// Compare with any mapping item by item, like collections.abc.Mapping.__eq__.
+        /// </summary>
+        static PyObject* PyCompare(PyObject* self, PyObject* other, int op)
+        {
+            if (op != Py_EQ && op != Py_NE)
+                Py_RETURN_NOTIMPLEMENTED;
+            bool map = PyObject_TypeCheck(other, Py_TYPE(self));
+            if (!map && !PyDict_Check(other))
+            {
+                Module abc(Str("collections.abc"));
+                int mapping = abc ? PyObject_IsInstance(other, abc.GetAttr("Mapping")) : -1;
+                if (mapping < 0)
+                    return nullptr;
+                if (mapping == 0)
+                    Py_RETURN_NOTIMPLEMENTED;
+            }
+            const State& a = NativeType<State>::Get(self);
+            if (map && a.root == NativeType<State>::Get(other).root)
+                return PyBool_FromLong(op == Py_EQ);
+            Py_ssize_t size = PyObject_Size(other);
+            if (size < 0)
+                return nullptr;
+            bool equal = (size_t)size == a.size;
+            Cursor cursor(a.root.get());
+            while (equal)
+            {
+                const Entry* entry = cursor.Next();
+                if (entry == nullptr)
+                    break;
+                Object value;
+                if (map)
+                    value.SetObject(Object(Find(NativeType<State>::Get(other).root.get(), 0, entry->hash, entry->key)));
+                else if (PyDict_Check(other))
+                    value.SetObject(Object(PyDict_GetItemWithError(other, entry->key)));
+                else
+                {
+                    value.SetObject(Py_ObjectWrap(PyObject_GetItem(other, entry->key)));
+                    if (!value && PyErr_ExceptionMatches(PyExc_KeyError))
+                        PyErr_Clear();
+                }
+                int same = value ? Equal(entry->value, value) : PyErr_Occurred() ? -1 : 0;
+                if (same < 0)
+                    return nullptr;
+                equal = same > 0;
+            }
+            return PyBool_FromLong(equal == (op == Py_EQ));
+        }
+
+        static PyObject* PyRepr(PyObject* self)
+        {
+            Object dict = Py_ObjWrap(PyToDict(self, nullptr));
+            return dict ? PyUnicode_FromFormat("Py.Map(%R)", (PyObject*)dict) : nullptr;
+        }
+    };
+
+    /// <summary>
+    /// Python expression compiled once and evaluated many times against a reusable globals dictionary.
+    /// <para>Variable slots are inserted up front with interned keys, so binding a value only replaces it in place.</para>
+    /// </summary>
+    class Expression : public Object
+    {
+    public:
+        /// <summary>
+        /// Compile an expression that reads the specified variables.
+        /// If compilation or setting up the globals fails, the object is null and an exception is set.
+        /// </summary>
+        /// <param name="base">Optional dictionary whose items are copied into the globals once, e.g. imported modules.</param>
+        Expression(const U8Str& source, std::initializer_list<const char*> variables, PyObject* base = nullptr)
+            : Py_ObjectWrap(Py_CompileString(source, "<expression>", Py_eval_input))
+        {
+            if (ptr == nullptr)
+                return;
+            bool ok = globals && (base == nullptr || PyDict_Update(globals, base) == 0)
+                && PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins()) == 0;
+            for (auto name = variables.begin(); ok && name != variables.end(); ++name)
+            {
+                names.emplace_back(PyUnicode_InternFromString(*name), false);
+                ok = names.back() && globals.SetItem(names.back(), None());
+            }
+            if (!ok)
+            {
+                names.clear();
+                Release();
+            }
+        }
+
+        /// <summary>
+        /// Get the slot index of a variable, or -1 if the expression was not compiled with it.
+        /// </summary>
+        ptrdiff_t GetSlot(const char* name) const
+        {
+            for (size_t i = 0; i < names.size(); i++)
+                if (std::strcmp(names[i].GetUTF8(), name) == 0)
+                    return i;
+            return -1;
+        }
+
+        /// <summary>
+        /// Bind a value to the variable in the specified slot.
+        /// Returns false with IndexError set if the slot does not exist.
+        /// </summary>
+        bool Set(size_t slot, const Object& value) const
+        {
+            if (slot >= names.size())
+            {
+                PyErr_Format(PyExc_IndexError, "expression has %zu variables, slot %zu does not exist", names.size(), slot);
+                return false;
+            }
+            return globals.SetItem(names[slot], value);
+        }
+
+        /// <summary>
+        /// Bind a value to the specified variable.
+        /// Returns false with NameError set if the expression was not compiled with it.
+        /// </summary>
+        bool Set(const char* name, const Object& value) const
+        {
+            ptrdiff_t slot = GetSlot(name);
+            if (slot < 0)
+            {
+                PyErr_Format(PyExc_NameError, "expression has no variable '%s'", name);
+                return false;
+            }
+            return Set(slot, value);
+        }
+
+        /// <summary>
+        /// Evaluate the expression with the currently bound values.
+        /// </summary>
+        Object Evaluate() const
+        {
+            if (ptr == nullptr)
+            {
+                PyErr_SetString(PyExc_RuntimeError, "expression did not compile or could not be set up");
+                return { };
+            }
+            return Py_ObjWrap(PyEval_EvalCode(ptr, globals, globals));
+        }
+
+        /// <summary>
+        /// Bind values to the variables in slot order, then evaluate the expression.
+        /// Returns a null object with an exception set if there are more values than variables or a value cannot be bound.
+        /// </summary>
+        template<typename... Values>
+        Object operator()(const Values&... values) const
+        {
+            if (sizeof...(Values) > names.size())
+            {
+                PyErr_Format(PyExc_TypeError, "expression takes %zu values (%zu given)", names.size(), sizeof...(Values));
+                return { };
+            }
+            size_t slot = 0;
+            if (!(Set(slot++, values) && ...))
+                return { };
+            return Evaluate();
+        }
+
+        /// <summary>
+        /// Get the globals dictionary the expression is evaluated in.
+        /// </summary>
+        const Dict& GetGlobals() const
+        {
+            return globals;
+        }
+
+    private:
+        Dict globals;
+        std::vector<Str> names;  // interned
+    };
+
+    /// <summary>
+    /// Applies a Python function of numbers to columns of doubles, producing one value per row.
+    /// <para>If the function only does arithmetic and comparisons on its arguments and numeric constants, and calls
+    /// math functions, abs, min and max, its bytecode is translated into steps that each run over a block of rows,
+    /// which the compiler can vectorize. Otherwise the function is called once per row.</para>
+    /// <para>Rows where any step produces a value that is not finite, or divides by zero, are recomputed by calling the
+    /// function, so results and exceptions match calling it with floats even when a later step such as min or a
+    /// comparison hides the problem. Globals are resolved when the kernel is compiled.</para>
+    /// </summary>
+    class Kernel
+    {
+    public:
+        enum class Path
+        {
+            Vectorized,
+            PerElement,
+        };
+
+        Kernel(const Object& fn)
+            : fn(fn)
+        {
+            if (!Compile())
+            {
+                steps.clear();
+                if (PyErr_Occurred())
+                {
+                    PyObject* type;
+                    PyObject* value;
+                    PyObject* traceback;
+                    PyErr_Fetch(&type, &value, &traceback);
+                    Object message = Py_ObjWrap(value ? PyObject_Str(value) : nullptr);
+                    reason = "analysis failed: " + (message ? (std::string)Str(message) : std::string("unknown error"));
+                    PyErr_Clear();
+                    Py_XDECREF(type);
+                    Py_XDECREF(value);
+                    Py_XDECREF(traceback);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Get how rows are computed.
+        /// </summary>
+        Path GetPath() const
+        {
+            return steps.empty() ? Path::PerElement : Path::Vectorized;
+        }
+
+        /// <summary>
+        /// Get why the function could not be vectorized, or an empty string.
+        /// </summary>
+        const std::string& GetReason() const
+        {
+            return reason;
+        }
+
+        /// <summary>
+        /// Compute out[i] = fn(columns[0][i], columns[1][i], ...). Must be called while holding the GIL.
+        /// Returns false with an exception set if the function raises or the columns do not match.
+        /// </summary>
+        bool Apply(std::span<const std::span<const double>> columns, std::span<double> out) const
+        {
+            for (const auto& column : columns)
+                if (column.size() != out.size())
+                {
+                    PyErr_Format(PyExc_ValueError, "column has %zu rows, expected %zu", column.size(), out.size());
+                    return false;
+                }
+            if (steps.empty())
+            {
+                for (size_t row = 0; row < out.size(); ++row)
+                    if (!CallRow(columns, row, out[row]))
+                        return false;
+                return true;
+            }
+            if (columns.size() != arity)
+            {
+                PyErr_Format(PyExc_TypeError, "kernel takes %zu columns (%zu given)", arity, columns.size());
+                return false;
+            }
+            std::vector<double> scratch(steps.size() * Block);
+            std::vector<const double*> registers(steps.size());
+            double poison[Block];
+            for (size_t begin = 0; begin < out.size(); begin += Block)
+            {
+                size_t n = std::min(Block, out.size() - begin);
+                std::fill_n(poison, n, 0.0);
+                for (size_t s = 0; s < steps.size(); ++s)
+                {
+                    registers[s] = Run(steps[s], registers, columns, begin, n, scratch.data() + s * Block);
+                    Poison(steps[s], registers, s, n, poison);
+                }
+                std::copy_n(registers[result], n, out.data() + begin);
+                for (size_t i = 0; i < n; ++i)
+                    if (poison[i] != 0 && !CallRow(columns, begin + i, out[begin + i]))
+                        return false;
+            }
+            return true;
+        }
+
+        bool Apply(std::initializer_list<std::span<const double>> columns, std::span<double> out) const
+        {
+            return Apply(std::span<const std::span<const double>>(columns.begin(), columns.size()), out);
+        }
+
+    private:
+        static constexpr size_t Block = 256;  // rows per step, so a block of every register stays in L1
+
+        enum class Op
+        {
+            Input, Constant, Add, Subtract, Multiply, Divide, FloorDivide, Modulo, Power, Negate,
+            Less, LessEqual, Equal, NotEqual, Greater, GreaterEqual, Unary, Binary,
+        };
+
+        struct Step
+        {
+            Op op;
+            size_t a = 0;  // register, or column for Input
+            size_t b = 0;
+            double value = 0;
+            double (*unary)(double) = nullptr;
+            double (*binary)(double, double) = nullptr;
+        };
+
+        /// <summary>
+        /// A value on the simulated evaluation stack: a register, or an object such as a module or a function.
+        /// </summary>
+        struct Value
+        {
+            size_t step;
+            Object object;  // null for a register
+        };
+
+        struct UnaryFunction
+        {
+            const char* name;
+            double (*fn)(double);
+        };
+
+        struct BinaryFunction
+        {
+            const char* name;
+            double (*fn)(double, double);
+        };
+
+        static constexpr UnaryFunction unary_functions[] = {
+            { "sqrt", [](double x) { return std::sqrt(x); } }, { "exp", [](double x) { return std::exp(x); } },
+            { "expm1", [](double x) { return std::expm1(x); } }, { "log", [](double x) { return std::log(x); } },
+            { "log2", [](double x) { return std::log2(x); } }, { "log10", [](double x) { return std::log10(x); } },
+            { "log1p", [](double x) { return std::log1p(x); } }, { "sin", [](double x) { return std::sin(x); } },
+            { "cos", [](double x) { return std::cos(x); } }, { "tan", [](double x) { return std::tan(x); } },
+            { "asin", [](double x) { return std::asin(x); } }, { "acos", [](double x) { return std::acos(x); } },
+            { "atan", [](double x) { return std::atan(x); } }, { "sinh", [](double x) { return std::sinh(x); } },
+            { "cosh", [](double x) { return std::cosh(x); } }, { "tanh", [](double x) { return std::tanh(x); } },
+            { "fabs", [](double x) { return std::fabs(x); } }, { "floor", [](double x) { return std::floor(x); } },
+            { "ceil", [](double x) { return std::ceil(x); } }, { "trunc", [](double x) { return std::trunc(x); } },
+            { "erf", [](double x) { return std::erf(x); } }, { "erfc", [](double x) { return std::erfc(x); } },
+        };
+
+        static constexpr BinaryFunction binary_functions[] = {
+            { "atan2", [](double y, double x) { return std::atan2(y, x); } },
+            { "hypot", [](double x, double y) { return std::hypot(x, y); } },
+            { "pow", [](double x, double y) { return std::pow(x, y); } },
+            { "fmod", [](double x, double y) { return std::fmod(x, y); } },
+            { "copysign", [](double x, double y) { return std::copysign(x, y); } },
+        };
+
+        // Python's float // and %, which round toward negative infinity.
+        static double FloorDivide(double x, double y)
+        {
+            double mod = std::fmod(x, y);
+            double div = (x - mod) / y;
+            if (mod != 0 && (y < 0) != (mod < 0))
+                div -= 1.0;
+            if (div == 0)
+                return std::copysign(0.0, x / y);
+            double floor = std::floor(div);
+            return div - floor > 0.5 ? floor + 1.0 : floor;
+        }
+
+        static double Modulo(double x, double y)
+        {
+            double mod = std::fmod(x, y);
+            if (mod == 0)
+                return std::copysign(0.0, y);
+            return (y < 0) != (mod < 0) ? mod + y : mod;
+        }
+
+        static const double* Run(const Step& step, const std::vector<const double*>& registers,
+            std::span<const std::span<const double>> columns, size_t begin, size_t n, double* r)
+        {
+            const double* x = registers[step.a];
+            const double* y = registers[step.b];
+            auto map = [&](auto f)
+            {
+                for (size_t i = 0; i < n; ++i)
+                    r[i] = f(x[i], y[i]);
+            };
+            switch (step.op)
+            {
+            case Op::Input: return columns[step.a].data() + begin;
+            case Op::Constant: std::fill_n(r, n, step.value); break;
+            case Op::Add: map([](double a, double b) { return a + b; }); break;
+            case Op::Subtract: map([](double a, double b) { return a - b; }); break;
+            case Op::Multiply: map([](double a, double b) { return a * b; }); break;
+            case Op::Divide: map([](double a, double b) { return a / b; }); break;
+            case Op::FloorDivide: map(&FloorDivide); break;
+            case Op::Modulo: map(&Modulo); break;
+            case Op::Power: map([](double a, double b) { return std::pow(a, b); }); break;
+            case Op::Negate: map([](double a, double) { return -a; }); break;
+            case Op::Less: map([](double a, double b) { return double(a < b); }); break;
+            case Op::LessEqual: map([](double a, double b) { return double(a <= b); }); break;
+            case Op::Equal: map([](double a, double b) { return double(a == b); }); break;
+            case Op::NotEqual: map([](double a, double b) { return double(a != b); }); break;
+            case Op::Greater: map([](double a, double b) { return double(a > b); }); break;
+            case Op::GreaterEqual: map([](double a, double b) { return double(a >= b); }); break;
+            case Op::Unary: for (size_t i = 0; i < n; ++i) r[i] = step.unary(x[i]); break;
+            case Op::Binary: for (size_t i = 0; i < n; ++i) r[i] = step.binary(x[i], y[i]); break;
+            }
+            return r;
+        }
+
+        /// <summary>
+        /// Poison the rows where Python may raise or compute something else: the step produced NaN or an infinity, or
+        /// divided by zero. A poisoned row holds NaN, a clean one zero.
+        /// <para>Multiplying by zero maps every finite value to zero and the rest to NaN. Unlike comparisons, which may
+        /// trap on NaN, this vectorizes without -fno-trapping-math.</para>
+        /// </summary>
+        static void Poison(const Step& step, const std::vector<const double*>& registers, size_t s, size_t n, double* poison)
+        {
+            // These cannot turn finite operands into anything else, and their operands were checked when computed.
+            bool comparison = step.op >= Op::Less && step.op <= Op::GreaterEqual;
+            if (comparison || step.op == Op::Negate || (step.op == Op::Constant && std::isfinite(step.value)))
+                return;
+            const double* r = registers[s];
+            for (size_t i = 0; i < n; ++i)
+                poison[i] += r[i] * 0.0;
+            if (step.op == Op::Divide || step.op == Op::FloorDivide || step.op == Op::Modulo)
+            {
+                const double* y = registers[step.b];
+                for (size_t i = 0; i < n; ++i)
+                    poison[i] += 0.0 / y[i];
+            }
+        }
+
+        bool CallRow(std::span<const std::span<const double>> columns, size_t row, double& out) const
+        {
+            std::vector<Object> args;
+            std::vector<PyObject*> argv;
+            args.reserve(columns.size());
+            for (const auto& column : columns)
+            {
+                args.emplace_back(PyFloat_FromDouble(column[row]), false);
+                if (!args.back())
+                    return false;
+                argv.push_back(args.back());
+            }
+            Object value = Py_ObjWrap(PyObject_Vectorcall(fn, argv.data(), argv.size(), nullptr));
+            if (!value)
+                return false;
+            out = PyFloat_AsDouble(value);
+            return !(out == -1.0 && PyErr_Occurred());
+        }
+
+        size_t Push(Step step)
+        {
+            steps.push_back(step);
+            return steps.size() - 1;
+        }
+
+        bool Fail(const std::string& why)
+        {
+            reason = why;
+            return false;
+        }
+
+        /// <summary>
+        /// Translate the bytecode by simulating the evaluation stack. Jumps, closures and keyword calls are not supported.
+        /// </summary>
+        bool Compile()
+        {
+            if (!PyFunction_Check((PyObject*)fn))
+                return Fail("not a Python function");
+            PyCodeObject* code = (PyCodeObject*)PyFunction_GET_CODE((PyObject*)fn);
+            if (code->co_flags & (CO_VARARGS | CO_VARKEYWORDS | CO_GENERATOR | CO_COROUTINE | CO_ASYNC_GENERATOR) || code->co_kwonlyargcount != 0)
+                return Fail("only positional parameters are supported");
+            arity = code->co_argcount;
+            Object varnames = Py_ObjWrap(PyObject_GetAttrString((PyObject*)code, "co_varnames"));
+            if (!varnames)
+                return false;
+            std::unordered_map<std::string, size_t> locals;
+            for (size_t i = 0; i < arity; ++i)
+                locals[PyUnicode_AsUTF8(PyTuple_GET_ITEM((PyObject*)varnames, i))] = Push({ Op::Input, i });
+
+            Object dis = Py_ObjWrap(PyImport_ImportModule("dis"));
+            Object math = Py_ObjWrap(PyImport_ImportModule("math"));
+            Object instructions(dis ? PyObject_CallMethod(dis, "get_instructions", "O", (PyObject*)fn) : nullptr, false);
+            Object list(instructions ? PySequence_List(instructions) : nullptr, false);
+            if (!math || !list)
+                return false;
+            std::vector<Value> stack;
+            auto pop = [&](Value& value)
+            {
+                if (stack.empty())
+                    return false;
+                value.step = stack.back().step;
+                value.object.SetObject(stack.back().object);
+                stack.pop_back();
+                return true;
+            };
+            auto pop_register = [&](size_t& step)
+            {
+                Value value;
+                if (!pop(value) || value.object)
+                    return false;
+                step = value.step;
+                return true;
+            };
+            auto push_object = [&](PyObject* object)
+            {
+                if (PyFloat_Check(object) || PyLong_Check(object))
+                {
+                    double value = PyFloat_AsDouble(object);
+                    if (value == -1.0 && PyErr_Occurred())
+                        return false;
+                    stack.push_back({ Push({ Op::Constant, 0, 0, value }), Object() });
+                }
+                else
+                    stack.push_back({ 0, Object(object) });
+                return true;
+            };
+
+            for (Py_ssize_t i = 0; i < PyList_GET_SIZE((PyObject*)list); ++i)
+            {
+                PyObject* instruction = PyList_GET_ITEM((PyObject*)list, i);
+                Object opname_object = Py_ObjWrap(PyObject_GetAttrString(instruction, "opname"));
+                Object argval = Py_ObjWrap(PyObject_GetAttrString(instruction, "argval"));
+                Object argrepr_object = Py_ObjWrap(PyObject_GetAttrString(instruction, "argrepr"));
+                if (!opname_object || !argval || !argrepr_object)
+                    return false;
+                std::string opname = Str(opname_object);
+                std::string argrepr = Str(argrepr_object);
+                size_t a, b;
+                Value value;
+                if (opname == "RESUME" || opname == "NOP" || opname == "PRECALL" || opname == "CACHE" || opname == "PUSH_NULL")
+                    continue;  // the NULL/self slot of calls is not modelled
+                if (opname == "LOAD_FAST" || opname == "LOAD_FAST_CHECK" || opname == "LOAD_FAST_LOAD_FAST")
+                {
+                    Object names = PyTuple_Check((PyObject*)argval) ? argval : Object(PyTuple_Pack(1, (PyObject*)argval), false);
+                    for (Py_ssize_t j = 0; j < PyTuple_GET_SIZE((PyObject*)names); ++j)
+                    {
+                        auto local = locals.find(PyUnicode_AsUTF8(PyTuple_GET_ITEM((PyObject*)names, j)));
+                        if (local == locals.end())
+                            return Fail("local variable read before assignment");
+                        stack.push_back({ local->second, Object() });
+                    }
+                }
+                else if (opname == "STORE_FAST")
+                {
+                    if (!pop_register(a))
+                        return Fail("non-numeric local variable");
+                    locals[Str(argval)] = a;
+                }
+                else if (opname == "LOAD_CONST" || opname == "RETURN_CONST")
+                {
+                    if (!push_object(argval))
+                        return false;
+                    if (opname == "RETURN_CONST")
+                        return pop_register(result) || Fail("non-numeric result");
+                }
+                else if (opname == "LOAD_GLOBAL" || opname == "LOAD_NAME")
+                {
+                    PyObject* global = PyDict_GetItemWithError(PyFunction_GET_GLOBALS((PyObject*)fn), argval);
+                    if (global == nullptr && !PyErr_Occurred())
+                        global = PyDict_GetItemWithError(PyEval_GetBuiltins(), argval);
+                    if (global == nullptr)
+                        return PyErr_Occurred() ? false : Fail("undefined global " + (std::string)Str(argval));
+                    if (!push_object(global))
+                        return false;
+                }
+                else if (opname == "LOAD_ATTR" || opname == "LOAD_METHOD")
+                {
+                    if (!pop(value) || !value.object || !PyModule_Check((PyObject*)value.object))
+                        return Fail("attribute of something other than a module");
+                    Object attr = value.object.GetAttr(argval);
+                    if (!attr || !push_object(attr))
+                        return false;
+                }
+                else if (opname == "BINARY_OP" || opname.starts_with("BINARY_") || opname.starts_with("INPLACE_"))
+                {
+                    static const std::unordered_map<std::string, Op> operators = {
+                        { "+", Op::Add }, { "-", Op::Subtract }, { "*", Op::Multiply }, { "/", Op::Divide },
+                        { "//", Op::FloorDivide }, { "%", Op::Modulo }, { "**", Op::Power },
+                        { "ADD", Op::Add }, { "SUBTRACT", Op::Subtract }, { "MULTIPLY", Op::Multiply }, { "TRUE_DIVIDE", Op::Divide },
+                        { "FLOOR_DIVIDE", Op::FloorDivide }, { "MODULO", Op::Modulo }, { "POWER", Op::Power },
+                    };
+                    std::string name = opname == "BINARY_OP" ? argrepr : opname.substr(opname.find('_') + 1);
+                    if (name.size() > 1 && name.back() == '=')
+                        name.pop_back();  // in-place operators behave the same on floats
+                    auto op = operators.find(name);
+                    if (op == operators.end())
+                        return Fail("unsupported instruction " + opname + " " + argrepr);
+                    if (!pop_register(b) || !pop_register(a))
+                        return Fail("arithmetic on a non-numeric value");
+                    stack.push_back({ Push({ op->second, a, b }), Object() });
+                }
+                else if (opname == "COMPARE_OP")
+                {
+                    static const std::unordered_map<std::string, Op> comparisons = {
+                        { "<", Op::Less }, { "<=", Op::LessEqual }, { "==", Op::Equal },
+                        { "!=", Op::NotEqual }, { ">", Op::Greater }, { ">=", Op::GreaterEqual },
+                    };
+                    auto op = comparisons.find(Str(argval));
+                    if (op == comparisons.end() || !pop_register(b) || !pop_register(a))
+                        return Fail("unsupported comparison " + argrepr);
+                    stack.push_back({ Push({ op->second, a, b }), Object() });
+                }
+                else if (opname == "UNARY_NEGATIVE")
+                {
+                    if (!pop_register(a))
+                        return Fail("negation of a non-numeric value");
+                    stack.push_back({ Push({ Op::Negate, a, a }), Object() });
+                }
+                else if (opname == "UNARY_POSITIVE" || (opname == "CALL_INTRINSIC_1" && argrepr == "INTRINSIC_UNARY_POSITIVE"))
+                {
+                    if (stack.empty() || stack.back().object)
+                        return Fail("unary plus of a non-numeric value");
+                }
+                else if (opname == "CALL" || opname == "CALL_FUNCTION" || opname == "CALL_METHOD")
+                {
+                    size_t count = PyLong_AsSize_t(argval);
+                    size_t args[2];
+                    if (count < 1 || count > 2)
+                        return Fail("unsupported call with " + std::to_string(count) + " arguments");
+                    for (size_t j = count; j-- > 0; )
+                        if (!pop_register(args[j]))
+                            return Fail("call with a non-numeric argument");
+                    if (!pop(value) || !value.object)
+                        return Fail("call of a number");
+                    Step step{ count == 1 ? Op::Unary : Op::Binary, args[0], count == 2 ? args[1] : args[0] };
+                    PyObject* builtins = PyEval_GetBuiltins();
+                    PyObject* callee = value.object;
+                    if (count == 1 && callee == PyDict_GetItemString(builtins, "abs"))
+                        step.unary = [](double x) { return std::fabs(x); };
+                    else if (count == 2 && callee == PyDict_GetItemString(builtins, "min"))
+                        step.binary = [](double x, double y) { return y < x ? y : x; };
+                    else if (count == 2 && callee == PyDict_GetItemString(builtins, "max"))
+                        step.binary = [](double x, double y) { return y > x ? y : x; };
+                    for (const UnaryFunction& function : unary_functions)
+                        if (count == 1 && step.unary == nullptr && callee == (PyObject*)math.GetAttr(function.name))
+                            step.unary = function.fn;
+                    for (const BinaryFunction& function : binary_functions)
+                        if (count == 2 && step.binary == nullptr && callee == (PyObject*)math.GetAttr(function.name))
+                            step.binary = function.fn;
+                    if (step.unary == nullptr && step.binary == nullptr)
+                        return Fail("call of unsupported function " + (std::string)Str(Object(PyObject_Repr(callee), false)));
+                    stack.push_back({ Push(step), Object() });
+                }
+                else if (opname == "RETURN_VALUE")
+                    return pop_register(result) || Fail("non-numeric result");
+                else
+                    return Fail("unsupported instruction " + opname);
+            }
+            return Fail("no return");
+        }
+
+        Object fn;
+        size_t arity = 0;
+        std::vector<Step> steps;  // each writes the register with its index
+        size_t result = 0;
+        std::string reason;
+    };
+
+    /// <summary>
+    /// Compile a Python function of numbers for applying it to columns of doubles; see Kernel.
+    /// </summary>
+    inline Kernel CompileKernel(const Object& fn)
+    {
+        return Kernel(fn);
+    }
+
+    /// <summary>
+    /// Publishes a versioned table of C function pointers as a capsule attribute of a module,
+    /// so other native extensions can call it directly instead of going through Python.
+    /// <para>New functions must only be appended to Struct; consumers accept any table at least as large as theirs.</para>
+    /// </summary>
+    template<typename Struct>
+    class CApi
+    {
+    public:
+        /// <summary>
+        /// Store the table as the capsule module.attr. The table must outlive the module.
+        /// </summary>
+        static bool Publish(const Module& module, const char* attr, const Struct* table, uint32_t version)
+        {
+            Object name = module.GetAttr("__name__");
+            if (!name)
+                return false;
+            Header* header = new Header{ version, (uint32_t)sizeof(Struct), table, Str(name).operator std::string() + "." + attr };
+            Object capsule = Py_ObjWrap(PyCapsule_New(header, header->name.data(), &DeleteHeader));
+            if (!capsule)
+            {
+                delete header;
+                return false;
+            }
+            return PyObject_SetAttrString(module, attr, capsule) == 0;
+        }
+
+        /// <summary>
+        /// Import the table published as 'module.attr'. Successful imports are cached per name; the version is checked on every call.
+        /// The cache keeps a reference to the capsule, so the table stays valid even if the attribute is replaced or deleted.
+        /// Returns nullptr with an exception set if it is missing, too old or smaller than Struct.
+        /// Must be called while holding the GIL, which guards the cache.
+        /// </summary>
+        static const Struct* Import(const char* name, uint32_t version = 0)
+        {
+            // Never destroyed: releasing the capsules after Py_Finalize would touch freed objects.
+            static auto& cache = *new std::map<std::string, Object, std::less<>>();
+            auto it = cache.find(std::string_view(name));
+            if (it == cache.end())
+            {
+                const char* attr = std::strrchr(name, '.');
+                if (attr == nullptr)
+                {
+                    PyErr_Format(PyExc_ImportError, "C API name '%s' is not of the form 'module.attr'", name);
+                    return nullptr;
+                }
+                Module module(Str(std::string(name, attr - name).data()));
+                if (!module)
+                    return nullptr;
+                Object capsule = module.GetAttr(attr + 1);
+                if (!capsule || PyCapsule_GetPointer(capsule, name) == nullptr)
+                    return nullptr;
+                it = cache.emplace(name, capsule).first;
+            }
+            const Header& header = *static_cast<const Header*>(PyCapsule_GetPointer(it->second, name));
+            if (header.version < version || header.size < sizeof(Struct))
+            {
+                PyErr_Format(PyExc_ImportError, "C API '%s' has version %u and size %u, expected at least version %u and size %zu",
+                    name, header.version, header.size, version, sizeof(Struct));
+                return nullptr;
+            }
+            return header.table;
+        }
+
+    private:
+        struct Header
+        {
+            uint32_t version;
+            uint32_t size;
+            const Struct* table;
+            std::string name;  // capsule name, must outlive the capsule
+        };
+
+        static void DeleteHeader(PyObject* capsule)
+        {
+            delete static_cast<Header*>(PyCapsule_GetPointer(capsule, PyCapsule_GetName(capsule)));
+        }
+    };
+
+    /// <summary>
+    /// Import a C function table published with CApi, caching it per name.
+    /// </summary>
+    template<typename Struct>
+    const Struct* Import(const char* name, uint32_t version = 0)
+    {
+        return CApi<Struct>::Import(name, version);
+    }
+
+    /// <summary>
+    /// Consumes a Python asynchronous iterator, such as an async generator, from a C++20 coroutine:
+    /// <code>while (Py::Object item = co_await it.Next()) { ... }</code>
+    /// <para>Steps that complete synchronously do not suspend. When Python awaits a future, the coroutine is resumed
+    /// from the future's done callback on the event loop thread, so no extra thread is needed.</para>
+    /// <para>Next yields a null object at the end of iteration, or on error with an exception set.</para>
+    /// <para>Steps are driven directly rather than by an asyncio Task. Once the iterator has suspended, asyncio.current_task()
+    /// is None and task-scoped helpers such as asyncio.timeout() raise RuntimeError; before that it is the caller's task.
+    /// Code that needs a task should run in one that the iterator awaits, e.g. await asyncio.create_task(...).</para>
+    /// </summary>
+    class AsyncIterator : public Object
+    {
+    public:
+        /// <summary>
+        /// Get the asynchronous iterator of an asynchronous iterable by calling its __aiter__.
+        /// </summary>
+        AsyncIterator(const Object& iterable)
+            : Py_ObjectWrap(GetAsyncIter(iterable))
+        { }
+
+        class Awaiter
+        {
+        public:
+            Awaiter(PyObject* iter)
+            {
+                PyAsyncMethods* async = Py_TYPE(iter)->tp_as_async;
+                if (async == nullptr || async->am_anext == nullptr)
+                {
+                    PyErr_Format(PyExc_TypeError, "'%s' object is not an async iterator", Py_TYPE(iter)->tp_name);
+                    return;
+                }
+                Object awaitable = Py_ObjWrap(async->am_anext(iter));
+                if (!awaitable)
+                    return;
+                async = Py_TYPE(awaitable)->tp_as_async;
+                if (async == nullptr || async->am_await == nullptr)
+                {
+                    PyErr_Format(PyExc_TypeError, "'%s' object can't be awaited", Py_TYPE(awaitable)->tp_name);
+                    return;
+                }
+                step.SetObject(Py_ObjectWrap(async->am_await(awaitable)));
+            }
+
+            Awaiter(const Awaiter&) = delete;
+            Awaiter& operator=(const Awaiter&) = delete;
+
+            /// <summary>
+            /// Detach from the event loop and close the pending step if the coroutine is destroyed while suspended.
+            /// </summary>
+            ~Awaiter()
+            {
+                if (!callback)
+                    return;
+                PyObject *type, *value, *traceback;
+                PyErr_Fetch(&type, &value, &traceback);
+                // The loop may already have queued the callback, so mark it dead before unregistering it.
+                PyCapsule_SetContext(PyCFunction_GET_SELF((PyObject*)callback), callback);
+                if (future)
+                    Object(Py_ObjectWrap(PyObject_CallMethod(future, "remove_done_callback", "O", (PyObject*)callback)));
+                if (scheduled)
+                    Object(Py_ObjectWrap(PyObject_CallMethod(scheduled, "cancel", nullptr)));
+                if ((future || scheduled) && step)
+                    Object(Py_ObjectWrap(PyObject_CallMethod(step, "close", nullptr)));
+                PyErr_Clear();
+                PyErr_Restore(type, value, traceback);
+            }
+
+            bool await_ready()
+            {
+                return Step();
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                this->handle = handle;
+                return Wait();
+            }
+
+            Object await_resume()
+            {
+                return item;
+            }
+
+        private:
+            /// <summary>
+            /// Advance the underlying awaitable until it finishes or blocks on a future.
+            /// </summary>
+            bool Step()
+            {
+                if (!step)
+                    return true;  // failed to start, exception set
+                for (;;)
+                {
+                    PyObject* result = nullptr;
+                    PySendResult status = PyIter_Send(step, Py_None, &result);
+                    if (status == PYGEN_RETURN)
+                    {
+                        item.SetObject(Py_ObjectWrap(result));
+                        return true;
+                    }
+                    if (status == PYGEN_ERROR)
+                    {
+                        if (PyErr_ExceptionMatches(PyExc_StopAsyncIteration))
+                            PyErr_Clear();
+                        return true;
+                    }
+                    Object yielded(result, false);
+                    if (!yielded.IsNone())
+                    {
+                        future.SetObject(yielded);
+                        return false;
+                    }
+                    // A bare yield, as in asyncio.sleep(0), asks to be rescheduled. Go through the running loop so that
+                    // other tasks get a turn; without one there is nothing else to run, so just step again.
+                    loop.SetObject(GetRunningLoop());
+                    if (loop)
+                        return false;
+                }
+            }
+
+            static Object GetRunningLoop()
+            {
+                Object asyncio = Py_ObjWrap(PyImport_ImportModule("asyncio"));
+                Object loop = Py_ObjWrap(asyncio ? PyObject_CallMethod(asyncio, "get_running_loop", nullptr) : nullptr);
+                PyErr_Clear();
+                return loop;
+            }
+
+            /// <summary>
+            /// Register to be resumed when the pending future completes, or on the next loop iteration after a bare yield.
+            /// Returns false, resuming the coroutine immediately, if that fails.
+            /// </summary>
+            bool Wait()
+            {
+                static PyMethodDef method { "resume", (PyCFunction)(void*)&OnDone, METH_O, nullptr };
+                if (!callback)
+                {
+                    Object self = Py_ObjWrap(PyCapsule_New(this, nullptr, nullptr));
+                    callback.SetObject(Py_ObjectWrap(self ? PyCFunction_New(&method, self) : nullptr));
+                }
+                if (callback && loop)
+                {
+                    scheduled.SetObject(Py_ObjectWrap(PyObject_CallMethod(loop, "call_soon", "OO", (PyObject*)callback, Py_None)));
+                    loop.Release();
+                    if (scheduled)
+                        return true;
+                }
+                else if (callback)
+                {
+                    // Mirror asyncio.Task, which clears the flag before waiting.
+                    if (PyObject_HasAttrString(future, "_asyncio_future_blocking"))
+                        PyObject_SetAttrString(future, "_asyncio_future_blocking", Py_False);
+                    if (Object(Py_ObjectWrap(PyObject_CallMethod(future, "add_done_callback", "O", (PyObject*)callback))))
+                        return true;
+                }
+                // Report the failure through the same path as a failed step.
+                step.Release();
+                return false;
+            }
+
+            static PyObject* OnDone(PyObject* self, PyObject*)
+            {
+                if (PyCapsule_GetContext(self) != nullptr)
+                    Py_RETURN_NONE;  // the awaiter is gone
+                Awaiter* awaiter = static_cast<Awaiter*>(PyCapsule_GetPointer(self, nullptr));
+                awaiter->future.Release();
+                awaiter->scheduled.Release();
+                if (awaiter->Step() || !awaiter->Wait())
+                {
+                    // The awaiter is destroyed once the coroutine moves on, so do not touch it afterwards.
+                    awaiter->handle.resume();
+                }
+                if (PyErr_Occurred())
+                {
+                    // An error left by the coroutine must not escape through the event loop callback.
+                    PyErr_WriteUnraisable(self);
+                }
+                Py_RETURN_NONE;
+            }
+
+            Object step;       // iterator of the __anext__ awaitable
+            Object future;     // pending future while suspended
+            Object loop;       // running loop after a bare yield, until rescheduled
+            Object scheduled;  // handle from call_soon while suspended on a bare yield
+            Object callback;   // resumes the awaiter; its capsule is marked dead by the destructor
+            Object item;
+            std::coroutine_handle<> handle;
+        };
+
+        /// <summary>
+        /// Get an awaitable for the next item.
+        /// </summary>
+        Awaiter Next() const
+        {
+            return Awaiter(ptr);
+        }
+
+    private:
+        static PyObject* GetAsyncIter(PyObject* iterable)
+        {
+            PyAsyncMethods* async = Py_TYPE(iterable)->tp_as_async;
+            if (async == nullptr || async->am_aiter == nullptr)
+            {
+                PyErr_Format(PyExc_TypeError, "'%s' object is not async iterable", Py_TYPE(iterable)->tp_name);
+                return nullptr;
+            }
+            return async->am_aiter(iterable);
+        }
+    };
+
+    /// <summary>
+    /// Module whose functions can be reloaded while the process keeps running.
+    /// Each load produces an immutable Version holding the function handles; Reload publishes a new one with an atomic swap.
+    /// <para>Callers keep the Version they acquired, so in-flight calls finish on the old code while new calls use the new one.</para>
+    /// <para>The last reference to a Version must be dropped while holding the GIL.</para>
+    /// </summary>
+    class ReloadableModule
+    {
+    public:
+        class Version
+        {
+        public:
+            /// <summary>
+            /// Get the function at the specified index, in the order given to the constructor.
+            /// </summary>
+            const Callable& Get(size_t index) const
+            {
+                return functions[index];
+            }
+
+            /// <summary>
+            /// Get the module object for this version.
+            /// </summary>
+            const Module& GetModule() const
+            {
+                return module;
+            }
+
+            /// <summary>
+            /// Get the number of successful loads up to and including this version.
+            /// </summary>
+            uint64_t GetEpoch() const
+            {
+                return epoch;
+            }
+
+        private:
+            friend class ReloadableModule;
+
+            Version(const Module& module, uint64_t epoch)
+                : module(module)
+                , epoch(epoch)
+            { }
+
+            Module module;
+            std::vector<Callable> functions;
+            uint64_t epoch;
+        };
+
+        /// <summary>
+        /// Import the module and resolve the specified functions.
+        /// If the initial load fails, Acquire returns nullptr and an exception is set.
+        /// </summary>
+        /// <param name="validate">Optional check run on a freshly loaded module before it is published.</param>
+        ReloadableModule(const char* name, std::initializer_list<const char*> functions, std::function<bool(const Module&)> validate = nullptr)
+            : name(name)
+            , names(functions.begin(), functions.end())
+            , validate(std::move(validate))
+        {
+            Publish(Module(Str(this->name)));
+        }
+
+        /// <summary>
+        /// Get the current version. Hold on to it for the duration of a call.
+        /// </summary>
+        std::shared_ptr<const Version> Acquire() const
+        {
+            return current.load();
+        }
+
+        /// <summary>
+        /// Get the index of a function, or -1 if it was not requested in the constructor.
+        /// </summary>
+        ptrdiff_t GetIndex(const char* function) const
+        {
+            for (size_t i = 0; i < names.size(); i++)
+                if (names[i] == function)
+                    return i;
+            return -1;
+        }
+
+        /// <summary>
+        /// Execute a fresh copy of the module, validate it and publish it.
+        /// The module in sys.modules is only replaced if validation succeeds.
+        /// </summary>
+        /// <returns>Returns false and keeps the current version if loading or validation fails.</returns>
+        bool Reload()
+        {
+            Module util(Str("importlib.util"));
+            if (!util)
+                return false;
+            Object spec = Callable(util.GetAttr("find_spec")).Call(Str(name));
+            if (!spec || spec.IsNone())
+                return false;
+            Module module = Callable(util.GetAttr("module_from_spec")).Call(spec);
+            if (!module)
+                return false;
+            Object loader = spec.GetAttr("loader");
+            if (!loader || !Callable(loader.GetAttr("exec_module")).Call(module))
+                return false;
+            if (!Publish(module))
+                return false;
+            // Unlike importlib.reload, which re-executes into the existing module object, this puts the new
+            // object into sys.modules; the old one lives on only in versions that are still acquired.
+            return PyDict_SetItemString(PyImport_GetModuleDict(), name.data(), module) == 0;
+        }
+
+    private:
+        bool Publish(const Module& module)
+        {
+            if (!module)
+                return false;
+            if (validate && !validate(module))
+            {
+                if (!PyErr_Occurred())
+                    PyErr_Format(PyExc_ImportError, "module '%s' failed validation", name.data());
+                return false;
+            }
+            std::shared_ptr<Version> version(new Version(module, ++epoch));
+            for (const std::string& function : names)
+            {
+                Callable fn = module.GetAttr(function.data());
+                if (!fn || !fn.IsCallable())
+                {
+                    if (!PyErr_Occurred())
+                        PyErr_Format(PyExc_ImportError, "'%s.%s' is not callable", name.data(), function.data());
+                    --epoch;
+                    return false;
+                }
+                version->functions.push_back(fn);
+            }
+            current.store(std::move(version));
+            return true;
+        }
+
+        std::string name;
+        std::vector<std::string> names;
+        std::function<bool(const Module&)> validate;
+        std::atomic<std::shared_ptr<const Version>> current;
+        uint64_t epoch = 0;  // only changed while holding the GIL
+    };
+
+    /// <summary>
+    /// Serializes Python values in the marshal format directly into caller-owned buffers.
+    /// <para>The output can be read by marshal.loads. Unlike PyMarshal_WriteObjectToString, no back-references are emitted,
+    /// so the bytes do not depend on reference counts.</para>
+    /// <para>Canonical output, for use as a key, also writes strings the same whether or not they are interned and sorts dict
+    /// and set entries by their encoding, so equal values produce the same bytes. It is slower for dicts and sets.</para>
+    /// </summary>
+    class Marshal
+    {
+    public:
+        /// <summary>
+        /// Get the number of bytes Dump appends for an object, or -1 with an exception set if it cannot be marshalled.
+        /// </summary>
+        static ptrdiff_t GetSize(const Object& obj, bool canonical = false)
+        {
+            Writer writer;
+            writer.canonical = canonical;
+            return writer.Write(obj, 0) ? (ptrdiff_t)writer.size : -1;
+        }
+
+        /// <summary>
+        /// Append the marshalled representation of an object to a buffer.
+        /// The buffer is grown once, to the exact size computed up front.
+        /// </summary>
+        /// <param name="canonical">Write equal values as the same bytes regardless of interning and insertion order.</param>
+        static bool Dump(const Object& obj, std::vector<std::byte>& buffer, bool canonical = false)
+        {
+            Writer writer;
+            writer.canonical = canonical;
+            if (!writer.Write(obj, 0))
+                return false;
+            size_t offset = buffer.size();
+            buffer.resize(offset + writer.size);
+            writer.out = buffer.data() + offset;
+            writer.size = 0;
+            writer.next = 0;
+            return writer.Write(obj, 0);
+        }
+
+        /// <summary>
+        /// Read an object from its marshalled representation.
+        /// </summary>
+        static Object Load(std::span<const std::byte> data)
+        {
+            if (data.empty())
+            {
+                // CPython would read from a file for a null pointer.
+                PyErr_SetString(PyExc_EOFError, "EOF read where object expected");
+                return { };
+            }
+            return Py_ObjWrap(PyMarshal_ReadObjectFromString((const char*)data.data(), data.size()));
+        }
+
+    private:
+        struct Writer
+        {
+            std::byte* out = nullptr;  // null while measuring
+            size_t size = 0;
+            std::vector<Object> blobs;  // produced by CPython for types written by the fallback, or sorted entries
+            size_t next = 0;
+            bool canonical = false;
+
+            void Put(const void* p, size_t n)
+            {
+                if (out != nullptr)
+                    std::memcpy(out + size, p, n);
+                size += n;
+            }
+
+            void PutByte(uint8_t value)
+            {
+                Put(&value, 1);
+            }
+
+            void PutInt32(int32_t value)
+            {
+                uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+                Put(bytes, 4);
+            }
+
+            void PutDouble(double value)
+            {
+                uint8_t bytes[8];
+                std::memcpy(bytes, &value, 8);
+                if constexpr (std::endian::native == std::endian::big)
+                    std::reverse(bytes, bytes + 8);
+                Put(bytes, 8);
+            }
+
+            bool PutSize(size_t n)
+            {
+                if (n > INT32_MAX)
+                {
+                    PyErr_SetString(PyExc_ValueError, "unmarshallable object");
+                    return false;
+                }
+                PutInt32((int32_t)n);
+                return true;
+            }
+
+            bool Write(PyObject* obj, int depth)
+            {
+                if (depth > 2000)
+                {
+                    PyErr_SetString(PyExc_ValueError, "object too deeply nested to marshal");
+                    return false;
+                }
+                if (obj == Py_None)
+                    PutByte('N');
+                else if (obj == Py_True)
+                    PutByte('T');
+                else if (obj == Py_False)
+                    PutByte('F');
+                else if (obj == Py_Ellipsis)
+                    PutByte('.');
+                else if (PyLong_CheckExact(obj))
+                {
+                    int overflow = 0;
+                    long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+                    if (overflow)
+                        return WriteFallback(obj);
+                    if (value >= INT32_MIN && value <= INT32_MAX)
+                    {
+                        PutByte('i');
+                        PutInt32((int32_t)value);
+                        return true;
+                    }
+                    // Magnitude in base 2**15 digits, sign in the digit count.
+                    unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+                    uint16_t digits[5];
+                    int32_t n = 0;
+                    for (; magnitude != 0; magnitude >>= 15)
+                        digits[n++] = (uint16_t)(magnitude & 0x7FFF);
+                    PutByte('l');
+                    PutInt32(value < 0 ? -n : n);
+                    for (int32_t i = 0; i < n; i++)
+                    {
+                        PutByte((uint8_t)digits[i]);
+                        PutByte((uint8_t)(digits[i] >> 8));
+                    }
+                }
+                else if (PyFloat_CheckExact(obj))
+                {
+                    PutByte('g');
+                    PutDouble(PyFloat_AS_DOUBLE(obj));
+                }
+                else if (PyComplex_CheckExact(obj))
+                {
+                    PutByte('y');
+                    PutDouble(PyComplex_RealAsDouble(obj));
+                    PutDouble(PyComplex_ImagAsDouble(obj));
+                }
+                else if (PyBytes_CheckExact(obj))
+                {
+                    PutByte('s');
+                    if (!PutSize(PyBytes_GET_SIZE(obj)))
+                        return false;
+                    Put(PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+                }
+                else if (PyUnicode_CheckExact(obj))
+                {
+                    // Canonical output always uses the non-interned codes, which marshal.loads reads back as equal strings.
+                    bool interned = !canonical && PyUnicode_CHECK_INTERNED(obj);
+                    if (PyUnicode_IS_ASCII(obj))
+                    {
+                        size_t n = PyUnicode_GET_LENGTH(obj);
+                        if (n < 256)
+                        {
+                            PutByte(interned ? 'Z' : 'z');
+                            PutByte((uint8_t)n);
+                        }
+                        else
+                        {
+                            PutByte(interned ? 'A' : 'a');
+                            if (!PutSize(n))
+                                return false;
+                        }
+                        Put(PyUnicode_DATA(obj), n);
+                        return true;
+                    }
+                    Py_ssize_t n = 0;
+                    const char* utf8 = PyUnicode_AsUTF8AndSize(obj, &n);
+                    if (utf8 == nullptr)
+                    {
+                        // Lone surrogates need the 'surrogatepass' handler.
+                        PyErr_Clear();
+                        return WriteFallback(obj);
+                    }
+                    PutByte(interned ? 't' : 'u');
+                    if (!PutSize(n))
+                        return false;
+                    Put(utf8, n);
+                }
+                else if (PyTuple_CheckExact(obj))
+                {
+                    size_t n = PyTuple_GET_SIZE(obj);
+                    if (n < 256)
+                    {
+                        PutByte(')');
+                        PutByte((uint8_t)n);
+                    }
+                    else
+                    {
+                        PutByte('(');
+                        if (!PutSize(n))
+                            return false;
+                    }
+                    for (size_t i = 0; i < n; i++)
+                        if (!Write(PyTuple_GET_ITEM(obj, i), depth + 1))
+                            return false;
+                }
+                else if (PyList_CheckExact(obj))
+                {
+                    size_t n = PyList_GET_SIZE(obj);
+                    PutByte('[');
+                    if (!PutSize(n))
+                        return false;
+                    for (size_t i = 0; i < n; i++)
+                        if (!Write(PyList_GET_ITEM(obj, i), depth + 1))
+                            return false;
+                }
+                else if (canonical && (PyDict_CheckExact(obj) || PySet_CheckExact(obj) || PyFrozenSet_CheckExact(obj)))
+                    return WriteSorted(obj, depth);
+                else if (PyDict_CheckExact(obj))
+                {
+                    Py_ssize_t pos = 0;
+                    PyObject* key;
+                    PyObject* value;
+                    PutByte('{');
+                    while (PyDict_Next(obj, &pos, &key, &value))
+                        if (!Write(key, depth + 1) || !Write(value, depth + 1))
+                            return false;
+                    PutByte('0');
+                }
+                else if (PySet_CheckExact(obj) || PyFrozenSet_CheckExact(obj))
+                {
+                    PutByte(PySet_CheckExact(obj) ? '<' : '>');
+                    if (!PutSize(PySet_GET_SIZE(obj)))
+                        return false;
+                    Object it = Py_ObjWrap(PyObject_GetIter(obj));
+                    if (!it)
+                        return false;
+                    while (PyObject* item = PyIter_Next(it))
+                    {
+                        Object ref(item, false);
+                        if (!Write(item, depth + 1))
+                            return false;
+                    }
+                    if (PyErr_Occurred())
+                        return false;
+                }
+                else
+                    return WriteFallback(obj);
+                return true;
+            }
+
+            /// <summary>
+            /// Encode an object on its own in canonical form, for sorting.
+            /// </summary>
+            static bool Encode(PyObject* obj, int depth, std::string& bytes)
+            {
+                Writer writer;
+                writer.canonical = true;
+                if (!writer.Write(obj, depth))
+                    return false;
+                bytes.resize(writer.size);
+                writer.out = (std::byte*)bytes.data();
+                writer.size = 0;
+                writer.next = 0;
+                return writer.Write(obj, depth);
+            }
+
+            /// <summary>
+            /// Write a dict or set with its entries sorted by their encoding rather than in insertion or hash order.
+            /// The encoding is built while measuring and kept as a blob for the second pass.
+            /// </summary>
+            bool WriteSorted(PyObject* obj, int depth)
+            {
+                if (out == nullptr)
+                {
+                    bool dict = PyDict_CheckExact(obj);
+                    std::vector<std::string> entries;
+                    entries.reserve(dict ? PyDict_GET_SIZE(obj) : PySet_GET_SIZE(obj));
+                    if (dict)
+                    {
+                        Py_ssize_t pos = 0;
+                        PyObject* key;
+                        PyObject* value;
+                        while (PyDict_Next(obj, &pos, &key, &value))
+                        {
+                            // Encodings are self-delimiting, so sorting key + value sorts by key first.
+                            std::string entry, encoded;
+                            if (!Encode(key, depth + 1, entry) || !Encode(value, depth + 1, encoded))
+                                return false;
+                            entries.push_back(entry + encoded);
+                        }
+                    }
+                    else
+                    {
+                        Object it = Py_ObjWrap(PyObject_GetIter(obj));
+                        if (!it)
+                            return false;
+                        while (PyObject* item = PyIter_Next(it))
+                        {
+                            Object ref(item, false);
+                            if (!Encode(item, depth + 1, entries.emplace_back()))
+                                return false;
+                        }
+                        if (PyErr_Occurred())
+                            return false;
+                    }
+                    std::sort(entries.begin(), entries.end());
+                    std::string blob(dict ? "{" : PySet_CheckExact(obj) ? "<" : ">");
+                    if (!dict)
+                    {
+                        if (entries.size() > INT32_MAX)
+                        {
+                            PyErr_SetString(PyExc_ValueError, "unmarshallable object");
+                            return false;
+                        }
+                        for (int shift = 0; shift < 32; shift += 8)
+                            blob += (char)(uint8_t)(entries.size() >> shift);
+                    }
+                    for (const std::string& entry : entries)
+                        blob += entry;
+                    if (dict)
+                        blob += '0';
+                    Object bytes = Py_ObjWrap(PyBytes_FromStringAndSize(blob.data(), blob.size()));
+                    if (!bytes)
+                        return false;
+                    blobs.push_back(bytes);
+                }
+                const Object& blob = blobs[next++];
+                Put(PyBytes_AS_STRING((PyObject*)blob), PyBytes_GET_SIZE((PyObject*)blob));
+                return true;
+            }
+
+            bool WriteFallback(PyObject* obj)
+            {
+                if (out == nullptr)
+                {
+                    // Version 2 never emits back-references, which would clash with the rest of the stream.
+                    Object blob = Py_ObjWrap(PyMarshal_WriteObjectToString(obj, 2));
+                    if (!blob)
+                        return false;
+                    blobs.push_back(blob);
+                }
+                const Object& blob = blobs[next++];
+                Put(PyBytes_AS_STRING((PyObject*)blob), PyBytes_GET_SIZE((PyObject*)blob));
+                return true;
+            }
+        };
+    };
+
+    /// <summary>
+    /// Holds a buffer exported by a Python object and exposes it as a contiguous byte span.
+    /// <para>The exporter is kept alive and locked (e.g. a bytearray cannot be resized) until the view is destroyed.
+    /// Construction and destruction must happen while holding the GIL; the span itself can be used without it.</para>
+    /// </summary>
+    class BufferView
+    {
+    public:
+        BufferView() = default;
+
+        /// <summary>
+        /// Request a C-contiguous buffer from an object. On failure the view is empty and an exception is set.
+        /// </summary>
+        BufferView(PyObject* obj, bool writable = false)
+        {
+            if (PyObject_GetBuffer(obj, &view, writable ? PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS : PyBUF_C_CONTIGUOUS))
+                view.obj = nullptr;
+        }
+
+        BufferView(BufferView&& other) noexcept
+            : view(other.view)
+        {
+            other.view.obj = nullptr;
+        }
+
+        BufferView& operator=(BufferView&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Release();
+                view = other.view;
+                other.view.obj = nullptr;
+            }
+            return *this;
+        }
+
+        BufferView(const BufferView&) = delete;
+        BufferView& operator=(const BufferView&) = delete;
+
+        ~BufferView()
+        {
+            Release();
+        }
+
+        /// <summary>
+        /// Get the exported bytes.
+        /// </summary>
+        std::span<const std::byte> GetSpan() const
+        {
+            return view.obj ? std::span<const std::byte>((const std::byte*)view.buf, view.len) : std::span<const std::byte>();
+        }
+
+        /// <summary>
+        /// Get the exported bytes for writing, or an empty span if the buffer is read-only.
+        /// </summary>
+        std::span<std::byte> GetWritableSpan() const
+        {
+            return view.obj && !view.readonly ? std::span<std::byte>((std::byte*)view.buf, view.len) : std::span<std::byte>();
+        }
+
+        /// <summary>
+        /// Get the object that exported the buffer.
+        /// </summary>
+        PyObject* GetExporter() const
+        {
+            return view.obj;
+        }
+
+        bool IsReadOnly() const
+        {
+            return !view.obj || view.readonly;
+        }
+
+        operator bool() const
+        {
+            return view.obj != nullptr;
+        }
+
+    private:
+        void Release()
+        {
+            if (view.obj != nullptr)
+                PyBuffer_Release(&view);
+        }
+
+        Py_buffer view { };
+    };
+
+    /// <summary>
+    /// Pickle protocol 5 with out-of-band buffers.
+    /// <para>Large buffers (bytearray, memoryview, NumPy arrays, ...) are not copied into the pickle stream: Dumps returns
+    /// them as views of the original memory, and Loads rebuilds objects directly on top of caller-owned memory.</para>
+    /// </summary>
+    class Pickle
+    {
+    public:
+        /// <summary>
+        /// Result of Dumps: the in-band stream followed by the out-of-band buffers, in the order Loads expects them.
+        /// </summary>
+        struct Pickled
+        {
+            Object header;  // bytes
+            std::vector<BufferView> buffers;
+
+            /// <summary>
+            /// Get the header and every buffer as a list of spans, suitable for a scatter/gather write.
+            /// </summary>
+            std::vector<std::span<const std::byte>> GetSpans() const
+            {
+                std::vector<std::span<const std::byte>> spans;
+                spans.reserve(buffers.size() + 1);
+                spans.emplace_back((const std::byte*)PyBytes_AS_STRING((PyObject*)header), PyBytes_GET_SIZE((PyObject*)header));
+                for (const BufferView& buffer : buffers)
+                    spans.push_back(buffer.GetSpan());
+                return spans;
+            }
+
+            operator bool() const
+            {
+                return header;
+            }
+        };
+
+        /// <summary>
+        /// Pickle an object with protocol 5, keeping PickleBuffer payloads out of band.
+        /// On failure the header is null and an exception is set.
+        /// </summary>
+        static Pickled Dumps(const Object& obj)
+        {
+            Pickled result;
+            Object pickle = Py_ObjWrap(PyImport_ImportModule("pickle"));
+            if (!pickle)
+                return result;
+            Object dumps = pickle.GetAttr("dumps");
+            Object buffers = Py_ObjWrap(PyList_New(0));
+            Object append = buffers ? buffers.GetAttr("append") : Object();
+            Object protocol = Py_ObjWrap(PyLong_FromLong(5));
+            if (!dumps || !append || !protocol)
+                return result;
+            PyObject* kwnames = Py_BuildValue("(ss)", "protocol", "buffer_callback");
+            if (!kwnames)
+                return result;
+            PyObject* args[] = { obj, protocol, append };
+            Object header = Py_ObjWrap(PyObject_Vectorcall(dumps, args, 1, kwnames));
+            Py_DECREF(kwnames);
+            if (!header)
+                return result;
+            Py_ssize_t count = PyList_GET_SIZE((PyObject*)buffers);
+            result.buffers.reserve(count);
+            for (Py_ssize_t i = 0; i < count; ++i)
+            {
+                // A non-contiguous PickleBuffer cannot be sent as a single span.
+                BufferView view(PyList_GET_ITEM((PyObject*)buffers, i));
+                if (!view)
+                {
+                    result.buffers.clear();
+                    return result;
+                }
+                result.buffers.push_back(std::move(view));
+            }
+            result.header.SetObject(header);
+            return result;
+        }
+
+        /// <summary>
+        /// Unpickle a protocol 5 stream whose out-of-band buffers are Python objects supporting the buffer protocol.
+        /// The reconstructed objects may keep references to these buffers.
+        /// </summary>
+        static Object Loads(const Object& header, const Object& buffers)
+        {
+            Object pickle = Py_ObjWrap(PyImport_ImportModule("pickle"));
+            if (!pickle)
+                return { };
+            Object loads = pickle.GetAttr("loads");
+            if (!loads)
+                return { };
+            PyObject* kwnames = Py_BuildValue("(s)", "buffers");
+            if (!kwnames)
+                return { };
+            PyObject* args[] = { header, buffers };
+            Object result = Py_ObjWrap(PyObject_Vectorcall(loads, args, 1, kwnames));
+            Py_DECREF(kwnames);
+            return result;
+        }
+
+        /// <summary>
+        /// Unpickle a protocol 5 stream from memory owned by C++, without copying.
+        /// <para>Each buffer is exposed to Python as a read-only memoryview over the span. Objects that adopt an
+        /// out-of-band buffer (NumPy arrays, memoryviews) read the caller's memory directly, so the spans must
+        /// outlive the returned object. Types that copy on reconstruction (bytes, bytearray) have no such requirement.</para>
+        /// </summary>
+        static Object Loads(std::span<const std::byte> header, std::span<const std::span<const std::byte>> buffers)
+        {
+            Object stream = Py_ObjWrap(PyMemoryView_FromMemory((char*)header.data(), header.size(), PyBUF_READ));
+            Object views = Py_ObjWrap(PyList_New(buffers.size()));
+            if (!stream || !views)
+                return { };
+            for (size_t i = 0; i < buffers.size(); ++i)
+            {
+                PyObject* view = PyMemoryView_FromMemory((char*)buffers[i].data(), buffers[i].size(), PyBUF_READ);
+                if (!view)
+                    return { };
+                PyList_SET_ITEM((PyObject*)views, i, view);
+            }
+            return Loads(stream, views);
+        }
+    };
+
+    /// <summary>
+    /// On-disk key-value store of marshalled Python results that survives restarts.
+    /// The file is memory-mapped when opened and values are only unmarshalled on first access.
+    /// <para>Every record carries a checksum; the file is discarded if it was written by another Python version or cache version.</para>
+    /// <para>All methods must be called while holding the GIL.</para>
+    /// </summary>
+    class PersistentCache
+    {
+    public:
+        /// <summary>
+        /// Open or create the cache file.
+        /// If the file cannot be opened, mapped or reset, OSError is set and IsOpen returns false.
+        /// A cache that is not open finds nothing, Put fails and Call always calls the function.
+        /// </summary>
+        /// <param name="version">Application-defined version of the cached results; bump it to invalidate old files.</param>
+        PersistentCache(const char* path, uint32_t version = 0)
+            : version(version)
+        {
+#ifdef _WIN32
+            file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                PyErr_SetExcFromWindowsErrWithFilename(PyExc_OSError, 0, path);
+                return;
+            }
+#else
+            file = open(path, O_RDWR | O_CREAT, 0644);
+            if (file == -1)
+            {
+                PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+                return;
+            }
+#endif
+            if (!Load())
+                Close();
+        }
+
+        PersistentCache(const PersistentCache&) = delete;
+        PersistentCache& operator=(const PersistentCache&) = delete;
+
+        ~PersistentCache()
+        {
+            Close();
+        }
+
+        /// <summary>
+        /// Check whether the cache file was opened successfully.
+        /// </summary>
+        bool IsOpen() const
+        {
+#ifdef _WIN32
+            return file != INVALID_HANDLE_VALUE;
+#else
+            return file != -1;
+#endif
+        }
+
+        /// <summary>
+        /// Get the value stored for a key, which must be marshallable.
+        /// Returns a null object without setting an exception if the key is not present or its record is corrupt.
+        /// </summary>
+        Object Get(const Object& key)
+        {
+            std::string bytes;
+            return GetBytes(key, bytes) ? Find(bytes) : Object();
+        }
+
+        /// <summary>
+        /// Store a value for a key. Both must be marshallable.
+        /// </summary>
+        bool Put(const Object& key, const Object& value)
+        {
+            std::string bytes;
+            return GetBytes(key, bytes) && Store(bytes, value);
+        }
+
+        /// <summary>
+        /// Call a function through the cache. The key is the function identity plus its arguments.
+        /// Arguments or results that cannot be marshalled bypass the cache.
+        /// </summary>
+        /// <param name="identity">Stable name of the function; defaults to its '__module__.__qualname__'.</param>
+        Object Call(const Callable& fn, const Object& args, const Object& kwargs = nullptr, const char* identity = nullptr)
+        {
+            std::string bytes;
+            if (!GetCallKey(fn, args, kwargs, identity, bytes))
+            {
+                PyErr_Clear();
+                return fn.Call(args, kwargs);
+            }
+            Object result = Find(bytes);
+            if (result)
+                return result;
+            result.SetObject(fn.Call(args, kwargs));
+            if (result && !Store(bytes, result))
+                PyErr_Clear();
+            return result;
+        }
+
+        /// <summary>
+        /// Wrap a function so that calls from C++ or Python go through this cache.
+        /// The cache must outlive the returned callable.
+        /// </summary>
+        Callable Wrap(const Callable& fn, const char* identity = nullptr)
+        {
+            static PyMethodDef method { "cached", (PyCFunction)(void*)&CallCached, METH_VARARGS | METH_KEYWORDS, nullptr };
+            static PyTypeObject* type = NativeType<Binding>::Create("Py.PersistentCacheBinding", { });
+            Object binding(NativeType<Binding>::New(type, this, fn, identity ? identity : ""), false);
+            if (!binding)
+                return { };
+            return Py_ObjWrap(PyCFunction_New(&method, binding));
+        }
+
+        /// <summary>
+        /// Get the number of records in the cache.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return index.size();
+        }
+
+    private:
+        struct Header
+        {
+            char magic[8];
+            uint32_t python;
+            uint32_t version;
+
+            static Header Current(uint32_t version)
+            {
+                return { { 'P', 'y', 'C', 'a', 'c', 'h', 'e', '1' }, PY_VERSION_HEX, version };
+            }
+
+            bool IsCurrent(uint32_t version) const
+            {
+                Header current = Current(version);
+                return std::memcmp(this, &current, sizeof(Header)) == 0;
+            }
+        };
+
+        struct Record
+        {
+            uint32_t key_size;
+            uint32_t value_size;
+            uint64_t checksum;
+        };
+
+        struct Entry
+        {
+            size_t offset;  // of the record
+            Object value;   // unmarshalled on first access
+        };
+
+        struct Binding
+        {
+            PersistentCache* cache;
+            Callable fn;
+            std::string identity;
+        };
+
+        static PyObject* CallCached(PyObject* self, PyObject* args, PyObject* kwargs)
+        {
+            Binding& binding = NativeType<Binding>::Get(self);
+            const char* identity = binding.identity.empty() ? nullptr : binding.identity.data();
+            return binding.cache->Call(binding.fn, args, kwargs, identity).AddRef();
+        }
+
+        static uint64_t Checksum(const char* p, size_t n, uint64_t hash = 14695981039346656037ull)
+        {
+            // FNV-1a
+            for (size_t i = 0; i < n; i++)
+                hash = (hash ^ (unsigned char)p[i]) * 1099511628211ull;
+            return hash;
+        }
+
+        static bool GetBytes(const Object& obj, std::string& bytes)
+        {
+            std::vector<std::byte> buffer;
+            if (!Marshal::Dump(obj, buffer, true))
+                return false;
+            bytes.assign((const char*)buffer.data(), buffer.size());
+            return true;
+        }
+
+        static bool GetCallKey(const Callable& fn, const Object& args, const Object& kwargs, const char* identity, std::string& bytes)
+        {
+            Object name;
+            if (identity != nullptr)
+                name.SetObject(Str(identity));
+            else
+            {
+                Object module = fn.GetAttr("__module__");
+                Object qualname = fn.GetAttr("__qualname__");
+                if (!module || !qualname)
+                    return false;
+                name.SetObject(Py_ObjectWrap(PyUnicode_FromFormat("%S.%S", (PyObject*)module, (PyObject*)qualname)));
+            }
+            Object items = kwargs ? Dict(kwargs).Items() : List();
+            if (!name || !items || !List(items).Sort())
+                return false;
+            return GetBytes(Tuple::FromValues(name, args, List(items).Tuple()), bytes);
+        }
+
+        Object Find(const std::string& key)
+        {
+            auto it = index.find(key);
+            if (it == index.end())
+                return { };
+            Entry& entry = it->second;
+            if (!entry.value)
+            {
+                Record record;
+                std::memcpy(&record, data + entry.offset, sizeof(Record));
+                const char* value = data + entry.offset + sizeof(Record) + record.key_size;
+                if (Checksum(value, record.value_size, Checksum(key.data(), key.size())) == record.checksum)
+                    entry.value.SetObject(Marshal::Load({ (const std::byte*)value, record.value_size }));
+                if (!entry.value)
+                {
+                    PyErr_Clear();
+                    index.erase(it);
+                    return { };
+                }
+            }
+            return entry.value;
+        }
+
+        bool Store(const std::string& key, const Object& value)
+        {
+            if (!IsOpen())
+            {
+                PyErr_SetString(PyExc_ValueError, "persistent cache is not open");
+                return false;
+            }
+            std::string bytes;
+            if (!GetBytes(value, bytes))
+                return false;
+            Record record { (uint32_t)key.size(), (uint32_t)bytes.size(), Checksum(bytes.data(), bytes.size(), Checksum(key.data(), key.size())) };
+            size_t offset = end;
+            if (!Append(&record, sizeof(Record)) || !Append(key.data(), key.size()) || !Append(bytes.data(), bytes.size()))
+            {
+#ifdef _WIN32
+                DWORD error = GetLastError();
+                Truncate(offset);
+                PyErr_SetFromWindowsErr(error);
+#else
+                int error = errno;
+                Truncate(offset);
+                errno = error;
+                PyErr_SetFromErrno(PyExc_OSError);
+#endif
+                return false;
+            }
+            // Records written in this session are never read back from the mapping.
+            index.erase(key);
+            index.emplace(key, Entry{ offset, value });
+            return true;
+        }
+
+        static bool RaiseLastError()
+        {
+#ifdef _WIN32
+            PyErr_SetFromWindowsErr(0);
+#else
+            PyErr_SetFromErrno(PyExc_OSError);
+#endif
+            return false;
+        }
+
+        bool Load()
+        {
+            if (!Map())
+                return false;
+            Header header { };
+            if (size < sizeof(Header) || (std::memcpy(&header, data, sizeof(Header)), !header.IsCurrent(version)))
+            {
+                Unmap();
+                header = Header::Current(version);
+                if (!Resize(0) || !(Append(&header, sizeof(Header)) || RaiseLastError()) || !Map())
+                    return false;
+            }
+            size_t end = Scan();
+            if (end < size)
+            {
+                // Drop a torn record left by an interrupted write so appends stay reachable.
+                Unmap();
+                return Resize(end) && Map();
+            }
+            return true;
+        }
+
+        void Close()
+        {
+            Unmap();
+            index.clear();
+            if (!IsOpen())
+                return;
+#ifdef _WIN32
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+#else
+            close(file);
+            file = -1;
+#endif
+        }
+
+        size_t Scan()
+        {
+            size_t offset = sizeof(Header);
+            Record record;
+            while (offset + sizeof(Record) <= size)
+            {
+                std::memcpy(&record, data + offset, sizeof(Record));
+                size_t next = offset + sizeof(Record) + record.key_size + record.value_size;
+                if (next > size)
+                    break;
+                std::string key(data + offset + sizeof(Record), record.key_size);
+                index.erase(key);
+                index.emplace(std::move(key), Entry{ offset, { } });
+                offset = next;
+            }
+            return end = offset;
+        }
+
+        bool Map()
+        {
+#ifdef _WIN32
+            LARGE_INTEGER length;
+            if (!GetFileSizeEx(file, &length))
+                return RaiseLastError();
+            size = (size_t)length.QuadPart;
+            if (size == 0)
+                return true;
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+            struct stat st;
+            if (fstat(file, &st) != 0)
+                return RaiseLastError();
+            size = (size_t)st.st_size;
+            if (size == 0)
+                return true;
+            void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+            data = p == MAP_FAILED ? nullptr : (const char*)p;
+#endif
+            return data != nullptr || RaiseLastError();
+        }
+
+        void Unmap()
+        {
+#ifdef _WIN32
+            if (data != nullptr)
+                UnmapViewOfFile(data);
+            if (mapping != nullptr)
+                CloseHandle(mapping);
+            mapping = nullptr;
+#else
+            if (data != nullptr)
+                munmap((void*)data, size);
+#endif
+            data = nullptr;
+        }
+
+        bool Resize(size_t n)
+        {
+#ifdef _WIN32
+            LARGE_INTEGER length;
+            length.QuadPart = n;
+            if (!SetFilePointerEx(file, length, nullptr, FILE_BEGIN) || !SetEndOfFile(file))
+                return RaiseLastError();
+#else
+            if (ftruncate(file, n) != 0)
+                return RaiseLastError();
+#endif
+            size = end = n;
+            return true;
+        }
+
+        bool Append(const void* p, size_t n)
+        {
+#ifdef _WIN32
+            LARGE_INTEGER offset;
+            offset.QuadPart = end;
+            DWORD written = 0;
+            if (!SetFilePointerEx(file, offset, nullptr, FILE_BEGIN) || !WriteFile(file, p, (DWORD)n, &written, nullptr))
+                return false;
+            if (written != n)
+            {
+                SetLastError(ERROR_WRITE_FAULT);
+                return false;
+            }
+#else
+            ssize_t written = pwrite(file, p, n, end);
+            if (written != (ssize_t)n)
+            {
+                if (written >= 0)
+                    errno = EIO;  // short write
+                return false;
+            }
+#endif
+            end += n;
+            return true;
+        }
+
+        /// <summary>
+        /// Cut the file back to the end of the last complete record after a failed append, so later records stay reachable.
+        /// The mapping is left alone: records appended in this session are never read back from it.
+        /// </summary>
+        void Truncate(size_t n)
+        {
+#ifdef _WIN32
+            LARGE_INTEGER length;
+            length.QuadPart = n;
+            SetFilePointerEx(file, length, nullptr, FILE_BEGIN);
+            SetEndOfFile(file);
+#else
+            // If this fails, the next record still overwrites the torn bytes from n on.
+            if (ftruncate(file, n) != 0)
+                errno = 0;
+#endif
+            end = n;
+        }
+
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int file = -1;
+#endif
+        const char* data = nullptr;
+        size_t size = 0;  // of the mapping
+        size_t end = 0;   // of the file
+        uint32_t version;
+        std::unordered_map<std::string, Entry> index;
+    };
+
+    /// <summary>
+    /// Holds the GIL using a thread state that is created once per C++ thread and interpreter.
+    /// The thread state stays bound for the lifetime of the thread, so entering Python is a GIL handoff, not an allocation.
+    /// <para>Bindings may be nested; only the outermost one acquires and releases the GIL.</para>
+    /// </summary>
+    class ThreadBinding
+    {
+    public:
+        /// <summary>
+        /// Acquire the GIL for the specified interpreter using this thread's bound thread state.
+        /// Throws std::runtime_error if the thread state cannot be created, and std::logic_error if the thread already
+        /// holds the GIL through another thread state.
+        /// </summary>
+        /// <param name="interp">The interpreter to enter. If nullptr, the main interpreter is used.</param>
+        ThreadBinding(PyInterpreterState* interp = nullptr)
+        {
+            entry = &GetEntry(interp ? interp : PyInterpreterState_Main());
+            if (entry->depth == 0 && HoldsGIL())
+                throw std::logic_error("ThreadBinding: the thread already holds the GIL through another thread state");
+            if (entry->depth++ == 0)
+                PyEval_RestoreThread(entry->tstate);
+        }
+
+        ThreadBinding(const ThreadBinding&) = delete;
+        ThreadBinding& operator=(const ThreadBinding&) = delete;
+
+        ~ThreadBinding()
+        {
+            if (--entry->depth == 0)
+                PyEval_SaveThread();
+        }
+
+        /// <summary>
+        /// Get the thread state bound to the calling thread for the specified interpreter.
+        /// </summary>
+        PyThreadState* GetThreadState() const
+        {
+            return entry->tstate;
+        }
+
+        /// <summary>
+        /// Destroy the thread state bound to the calling thread for the specified interpreter, if any.
+        /// This must be called before a subinterpreter is ended by a thread that entered it.
+        /// The calling thread must not hold the GIL.
+        /// </summary>
+        /// <returns>Returns false, keeping the thread state, if a ThreadBinding for the interpreter is still alive on this thread.</returns>
+        static bool Unbind(PyInterpreterState* interp = nullptr)
+        {
+            Bindings& bindings = GetBindings();
+            if (interp == nullptr)
+                interp = PyInterpreterState_Main();
+            for (auto it = bindings.entries.begin(); it != bindings.entries.end(); ++it)
+            {
+                if (it->interp == interp)
+                {
+                    if (it->depth > 0)
+                        return false;
+                    Delete(it->tstate);
+                    bindings.entries.erase(it);
+                    return true;
+                }
+            }
+            return true;
+        }
+
+    private:
+        struct Entry
+        {
+            PyInterpreterState* interp;
+            PyThreadState* tstate;
+            size_t depth;
+        };
+
+        struct Bindings
+        {
+            std::list<Entry> entries;  // stable addresses
+
+            ~Bindings()
+            {
+                // The interpreter may already be gone at thread exit.
+                if (!Py_IsInitialized())
+                    return;
+                for (Entry& entry : entries)
+                    Delete(entry.tstate);
+            }
+        };
+
+        static Bindings& GetBindings()
+        {
+            thread_local Bindings bindings;
+            return bindings;
+        }
+
+        static Entry& GetEntry(PyInterpreterState* interp)
+        {
+            Bindings& bindings = GetBindings();
+            for (Entry& entry : bindings.entries)
+                if (entry.interp == interp)
+                    return entry;
+            // PyThreadState_New may be called without holding the GIL.
+            PyThreadState* tstate = PyThreadState_New(interp);
+            if (tstate == nullptr)
+                throw std::runtime_error("ThreadBinding: cannot create a thread state");
+            return bindings.entries.emplace_back(Entry{ interp, tstate, 0 });
+        }
+
+        /// <summary>
+        /// Determine if the calling thread holds the GIL through any thread state, e.g. one from PyGILState_Ensure.
+        /// Restoring a second thread state would then wait for the GIL forever.
+        /// </summary>
+        static bool HoldsGIL()
+        {
+#if PY_VERSION_HEX >= 0x030D0000
+            PyThreadState* current = PyThreadState_GetUnchecked();
+#else
+            PyThreadState* current = _PyThreadState_UncheckedGet();
+#endif
+            // Not PyGILState_Check: it always succeeds once a subinterpreter exists.
+            return current != nullptr && current->thread_id == PyThread_get_thread_ident();
+        }
+
+        static void Delete(PyThreadState* tstate)
+        {
+            PyEval_RestoreThread(tstate);
+            PyThreadState_Clear(tstate);
+            PyThreadState_DeleteCurrent();
+        }
+
+        Entry* entry;
+    };
+
+    /// <summary>
+    /// Fixed-size pool of C++ threads with one job deque per worker.
+    /// Workers pop their own deque from the back and steal from the front of the others when idle.
+    /// <para>Jobs run without the GIL; use ThreadBinding inside a job to enter Python.</para>
+    /// <para>Workers share ownership of the queues, so a job may destroy the pool that runs it: that worker is detached
+    /// and finishes the queued jobs on its own.</para>
+    /// </summary>
+    class ThreadPool
+    {
+    public:
+        ThreadPool(size_t threads = std::thread::hardware_concurrency())
+            : shared(std::make_shared<Shared>())
+        {
+            threads = std::max<size_t>(1, threads);
+            for (size_t i = 0; i < threads; i++)
+                shared->queues.push_back(std::make_unique<Queue>());
+            for (size_t i = 0; i < threads; i++)
+                workers.emplace_back([shared = shared, i] { shared->Run(i); });
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool()
+        {
+            Shutdown();
+        }
+
+        /// <summary>
+        /// Queue a job. Jobs submitted from a worker go to that worker's own deque.
+        /// </summary>
+        /// <returns>Returns false if the pool is shutting down.</returns>
+        bool Submit(std::function<void()> job)
+        {
+            Shared& shared = *this->shared;
+            size_t index = current.pool == &shared ? current.index : shared.next++ % shared.queues.size();
+            {
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                if (shared.stopping)
+                    return false;
+                ++shared.pending;
+            }
+            {
+                std::lock_guard<std::mutex> lock(shared.queues[index]->mutex);
+                shared.queues[index]->jobs.push_back(std::move(job));
+            }
+            shared.wakeup.notify_one();
+            return true;
+        }
+
+        /// <summary>
+        /// Remove the queued jobs that have not started yet and return them to the caller.
+        /// </summary>
+        std::vector<std::function<void()>> Drain()
+        {
+            Shared& shared = *this->shared;
+            std::vector<std::function<void()>> jobs;
+            for (std::unique_ptr<Queue>& queue : shared.queues)
+            {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                std::move(queue->jobs.begin(), queue->jobs.end(), std::back_inserter(jobs));
+                queue->jobs.clear();
+            }
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            shared.pending -= jobs.size();
+            return jobs;
+        }
+
+        /// <summary>
+        /// Stop accepting jobs. The queued ones still run.
+        /// Must not be called with wait while holding the GIL if queued jobs need it.
+        /// </summary>
+        /// <param name="wait">If true, wait for the queued jobs and join the workers.</param>
+        void Shutdown(bool wait = true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->stopping = true;
+            }
+            shared->wakeup.notify_all();
+            if (!wait)
+                return;
+            for (std::thread& worker : workers)
+            {
+                if (!worker.joinable())
+                    continue;
+                if (worker.get_id() == std::this_thread::get_id())
+                    worker.detach();  // called from one of its own jobs, the worker keeps the queues alive
+                else
+                    worker.join();
+            }
+        }
+
+        /// <summary>
+        /// Get the number of worker threads.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return workers.size();
+        }
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> jobs;
+        };
+
+        struct Shared;
+
+        struct Current
+        {
+            Shared* pool;
+            size_t index;
+        };
+
+        struct Shared
+        {
+            bool Pop(size_t index, std::function<void()>& job)
+            {
+                for (size_t i = 0; i < queues.size(); i++)
+                {
+                    Queue& queue = *queues[(index + i) % queues.size()];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (queue.jobs.empty())
+                        continue;
+                    if (i == 0)
+                    {
+                        job = std::move(queue.jobs.back());
+                        queue.jobs.pop_back();
+                    }
+                    else
+                    {
+                        job = std::move(queue.jobs.front());
+                        queue.jobs.pop_front();
+                    }
+                    return true;
+                }
+                return false;
+            }
+
+            void Run(size_t index)
+            {
+                current = { this, index };
+                std::function<void()> job;
+                for (;;)
+                {
+                    if (Pop(index, job))
+                    {
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            --pending;
+                        }
+                        job();
+                        job = nullptr;
+                        continue;
+                    }
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wakeup.wait(lock, [this] { return pending > 0 || stopping; });
+                    if (pending == 0 && stopping)
+                        return;
+                }
+            }
+
+            std::vector<std::unique_ptr<Queue>> queues;
+            std::atomic<size_t> next = 0;
+            std::mutex mutex;
+            std::condition_variable wakeup;
+            size_t pending = 0;
+            bool stopping = false;
+        };
+
+        static inline thread_local Current current { };
+
+        std::shared_ptr<Shared> shared;
+        std::vector<std::thread> workers;
+    };
+
+    /// <summary>
+    /// Executor for Python code backed by a C++ ThreadPool.
+    /// submit(fn, *args, **kwargs) releases the GIL while queueing and returns a concurrent.futures.Future,
+    /// so results work with concurrent.futures.wait and asyncio.wrap_future.
+    /// <para>Workers keep their thread state bound (see ThreadBinding) and only hold the GIL to run fn and publish the result.</para>
+    /// </summary>
+    class Executor : public Object
+    {
+    public:
+        Executor(const Object& obj)
+            : Object(obj)
+        { }
+
+        Executor(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Create an executor with the specified number of worker threads.
+        /// </summary>
+        Executor(size_t threads = std::thread::hardware_concurrency())
+            : Object(NativeType<State>::New(GetType(), threads, PyInterpreterState_Get()), false)
+        { }
+
+        /// <summary>
+        /// Call fn(*args, **kwargs) on a worker thread and return a concurrent.futures.Future for the result.
+        /// </summary>
+        Object Submit(const Callable& fn, const Object& args, const Object& kwargs = nullptr) const
+        {
+            return Py_ObjWrap(NativeType<State>::Get(ptr).Submit(fn, args, kwargs));
+        }
+
+        /// <summary>
+        /// Queue a C++ job that runs without the GIL.
+        /// </summary>
+        bool Submit(std::function<void()> job) const
+        {
+            State& state = NativeType<State>::Get(ptr);
+            bool queued;
+            Py_BEGIN_ALLOW_THREADS
+            queued = state.pool.Submit(std::move(job));
+            Py_END_ALLOW_THREADS
+            return queued;
+        }
+
+        /// <summary>
+        /// Stop accepting work and wait for the queued work to finish. The GIL is released while waiting.
+        /// </summary>
+        /// <param name="cancel">If true, drop the work that has not started and cancel its futures instead.</param>
+        void Shutdown(bool cancel = false) const
+        {
+            State& state = NativeType<State>::Get(ptr);
+            if (cancel)
+                state.Cancel();
+            state.Shutdown();
+        }
+
+    private:
+        struct Job
+        {
+            Object fn;
+            Object args;
+            Object kwargs;
+            Object future;
+        };
+
+        struct Task
+        {
+            void operator()() const
+            {
+                State::Run(job, interp);
+            }
+
+            Job* job;
+            PyInterpreterState* interp;
+        };
+
+        struct State
+        {
+            State(size_t threads, PyInterpreterState* interp)
+                : pool(threads)
+                , interp(interp)
+                , future_type(Module(Str("concurrent.futures")).GetAttr("Future"))
+            {
+                if (!future_type)
+                    throw;
+            }
+
+            ~State()
+            {
+                Shutdown();
+            }
+
+            PyObject* Submit(PyObject* fn, PyObject* args, PyObject* kwargs)
+            {
+                Object future = Py_ObjWrap(PyObject_CallNoArgs(future_type));
+                if (!future)
+                    return nullptr;
+                Job* job = new Job{ fn, args, kwargs, future };
+                PyInterpreterState* interp = this->interp;
+                bool queued;
+                Py_BEGIN_ALLOW_THREADS
+                queued = pool.Submit(Task{ job, interp });
+                Py_END_ALLOW_THREADS
+                if (!queued)
+                {
+                    delete job;
+                    PyErr_SetString(PyExc_RuntimeError, "cannot schedule new futures after shutdown");
+                    return nullptr;
+                }
+                return future.AddRef();
+            }
+
+            void Shutdown(bool wait = true)
+            {
+                Py_BEGIN_ALLOW_THREADS
+                pool.Shutdown(wait);
+                Py_END_ALLOW_THREADS
+            }
+
+            /// <summary>
+            /// Stop accepting work, then drop the queued jobs that have not started and cancel their futures.
+            /// </summary>
+            void Cancel()
+            {
+                std::vector<std::function<void()>> jobs;
+                Py_BEGIN_ALLOW_THREADS
+                pool.Shutdown(false);
+                jobs = pool.Drain();
+                Py_END_ALLOW_THREADS
+                for (std::function<void()>& function : jobs)
+                {
+                    if (Task* task = function.target<Task>())
+                    {
+                        if (!Object(Py_ObjectWrap(PyObject_CallMethod(task->job->future, "cancel", nullptr))))
+                            PyErr_WriteUnraisable(task->job->fn);
+                        delete task->job;
+                    }
+                }
+                jobs.clear();  // C++ jobs are dropped without running
+            }
+
+            static void Run(Job* job, PyInterpreterState* interp)
+            {
+                ThreadBinding binding(interp);
+                Object running = Callable(job->future.GetAttr("set_running_or_notify_cancel")).Call();
+                if (running && PyObject_IsTrue(running) == 1)
+                {
+                    Object result = Py_ObjWrap(PyObject_Call(job->fn, job->args, job->kwargs));
+                    if (result)
+                        Callable(job->future.GetAttr("set_result")).Call(result);
+                    else
+                    {
+                        PyObject* type;
+                        PyObject* value;
+                        PyObject* traceback;
+                        PyErr_Fetch(&type, &value, &traceback);
+                        PyErr_NormalizeException(&type, &value, &traceback);
+                        if (traceback != nullptr)
+                            PyException_SetTraceback(value, traceback);
+                        Callable(job->future.GetAttr("set_exception")).Call(Object(value));
+                        Py_XDECREF(type);
+                        Py_XDECREF(value);
+                        Py_XDECREF(traceback);
+                    }
+                }
+                if (PyErr_Occurred())
+                    PyErr_WriteUnraisable(job->fn);
+                delete job;  // releases the Python objects while holding the GIL
+            }
+
+            ThreadPool pool;
+            PyInterpreterState* interp;
+            Object future_type;
+        };
+
+        static PyTypeObject* GetType()
+        {
+            static PyMethodDef methods[] = {
+                { "submit", (PyCFunction)(void*)&PySubmit, METH_FASTCALL | METH_KEYWORDS, "submit(fn, /, *args, **kwargs)\n--\n\nSchedule fn(*args, **kwargs) and return a concurrent.futures.Future." },
+                { "shutdown", (PyCFunction)(void*)&PyShutdown, METH_VARARGS | METH_KEYWORDS, "shutdown(wait=True, *, cancel_futures=False)\n--\n\nStop accepting work and wait for queued work to finish, or cancel the work that has not started." },
+                { "__enter__", (PyCFunction)(void*)&PyEnter, METH_NOARGS, nullptr },
+                { "__exit__", (PyCFunction)(void*)&PyExit, METH_VARARGS, nullptr },
+                { }
+            };
+            static PyTypeObject* type = NativeType<State>::Create("Py.Executor", {
+                { Py_tp_methods, (void*)methods },
+            });
+            return type;
+        }
+
+        static PyObject* PySubmit(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+        {
+            if (nargs < 1)
+            {
+                PyErr_SetString(PyExc_TypeError, "submit() missing required argument 'fn'");
+                return nullptr;
+            }
+            Object tuple = Py_ObjWrap(PyTuple_New(nargs - 1));
+            Object kwargs = Py_ObjWrap(kwnames ? PyDict_New() : nullptr);
+            if (!tuple || (kwnames && !kwargs))
+                return nullptr;
+            for (Py_ssize_t i = 1; i < nargs; i++)
+                PyTuple_SET_ITEM((PyObject*)tuple, i - 1, Py_NewRef(args[i]));
+            for (Py_ssize_t i = 0; kwnames && i < PyTuple_GET_SIZE(kwnames); i++)
+                if (PyDict_SetItem(kwargs, PyTuple_GET_ITEM(kwnames, i), args[nargs + i]) != 0)
+                    return nullptr;
+            return NativeType<State>::Get(self).Submit(args[0], tuple, kwargs);
+        }
+
+        static PyObject* PyShutdown(PyObject* self, PyObject* args, PyObject* kwargs)
+        {
+            static const char* keywords[] = { "wait", "cancel_futures", nullptr };
+            int wait = 1;
+            int cancel = 0;
+            if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pp:shutdown", (char**)keywords, &wait, &cancel))
+                return nullptr;
+            State& state = NativeType<State>::Get(self);
+            if (cancel)
+                state.Cancel();
+            state.Shutdown(wait);
+            Py_RETURN_NONE;
+        }
+
+        static PyObject* PyEnter(PyObject* self, PyObject*)
+        {
+            return Py_NewRef(self);
+        }
+
+        static PyObject* PyExit(PyObject* self, PyObject*)
+        {
+            NativeType<State>::Get(self).Shutdown();
+            Py_RETURN_FALSE;
+        }
+    };
+
+    /// <summary>
+    /// Bounded lock-free multi-producer multi-consumer ring buffer (Vyukov's sequence-numbered cells).
+    /// <para>TryPush and TryPop never block or touch Python. Wait and Notify let callers sleep on the readable and
+    /// writable events; Notify is cheap when nobody is waiting.</para>
+    /// </summary>
+    template<typename T>
+    class Ring
+    {
+    public:
+        struct Event
+        {
+            std::condition_variable cv;
+            std::atomic<size_t> sleepers = 0;
+        };
+
+        /// <summary>
+        /// Create a ring holding up to capacity items, rounded up to a power of two.
+        /// </summary>
+        explicit Ring(size_t capacity)
+            : cells(new Cell[std::bit_ceil(std::max<size_t>(capacity, 2))])
+            , mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1)
+        {
+            for (size_t i = 0; i <= mask; ++i)
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        Ring(const Ring&) = delete;
+        Ring& operator=(const Ring&) = delete;
+
+        ~Ring()
+        {
+            while (TryPop())
+                ;
+        }
+
+        /// <summary>
+        /// Add an item if there is room, moving from value. Returns false and leaves value untouched if full.
+        /// </summary>
+        bool TryPush(T& value)
+        {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                Cell& cell = cells[pos & mask];
+                size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                ptrdiff_t diff = (ptrdiff_t)(sequence - pos);
+                if (diff == 0)
+                {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        new (cell.storage) T(std::move(value));
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        /// <summary>
+        /// Remove the oldest item, if any.
+        /// </summary>
+        std::optional<T> TryPop()
+        {
+            size_t pos = head.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                Cell& cell = cells[pos & mask];
+                size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                ptrdiff_t diff = (ptrdiff_t)(sequence - (pos + 1));
+                if (diff == 0)
+                {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        std::optional<T> value(std::move(*cell.Get()));
+                        cell.Get()->~T();
+                        cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                        return value;
+                    }
+                }
+                else if (diff < 0)
+                    return std::nullopt;
+                else
+                    pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        bool IsEmpty() const
+        {
+            size_t pos = head.load(std::memory_order_relaxed);
+            return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos + 1;
+        }
+
+        bool IsFull() const
+        {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos;
+        }
+
+        /// <summary>
+        /// Get the approximate number of items; exact when no other thread is using the ring.
+        /// </summary>
+        size_t GetSize() const
+        {
+            size_t first = head.load(std::memory_order_acquire);
+            size_t last = tail.load(std::memory_order_acquire);
+            return last > first ? std::min(last - first, mask + 1) : 0;
+        }
+
+        size_t GetCapacity() const
+        {
+            return mask + 1;
+        }
+
+        /// <summary>
+        /// Call f on each queued item, oldest first. Items pushed concurrently may or may not be seen;
+        /// no other thread may pop meanwhile.
+        /// </summary>
+        template<typename Function>
+        void ForEach(Function f) const
+        {
+            size_t last = tail.load(std::memory_order_acquire);
+            for (size_t pos = head.load(std::memory_order_acquire); pos != last; ++pos)
+            {
+                Cell& cell = cells[pos & mask];
+                if (cell.sequence.load(std::memory_order_acquire) == pos + 1)
+                    f(*cell.Get());
+            }
+        }
+
+        /// <summary>
+        /// Sleep until ready() returns true or the timeout expires. Returns the last result of ready().
+        /// The predicate is checked under the same lock Notify takes, so no wakeup is missed.
+        /// </summary>
+        template<typename Predicate>
+        bool Wait(Event& event, Predicate ready, std::chrono::milliseconds timeout = std::chrono::milliseconds::max())
+        {
+            std::unique_lock lock(mutex);
+            event.sleepers.fetch_add(1);
+            bool result = timeout == std::chrono::milliseconds::max()
+                ? (event.cv.wait(lock, ready), true)
+                : event.cv.wait_for(lock, timeout, ready);
+            event.sleepers.fetch_sub(1);
+            return result;
+        }
+
+        /// <summary>
+        /// Wake the threads sleeping on an event after changing the state their predicate reads.
+        /// </summary>
+        void Notify(Event& event)
+        {
+            // Pairs with the sleeper count being raised before the predicate is checked.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (event.sleepers.load(std::memory_order_relaxed) == 0)
+                return;
+            {
+                std::lock_guard lock(mutex);
+            }
+            event.cv.notify_all();
+        }
+
+        Event readable;
+        Event writable;
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            alignas(T) std::byte storage[sizeof(T)];
+
+            T* Get()
+            {
+                return std::launder(reinterpret_cast<T*>(storage));
+            }
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head = 0;
+        alignas(64) std::atomic<size_t> tail = 0;
+        alignas(64) std::mutex mutex;
+    };
+
+    /// <summary>
+    /// Bounded ring buffer that hands items from C++ producer threads to a Python consumer.
+    /// <para>Producers never touch the GIL or Python objects. On the Python side the stream is an iterator
+    /// that converts each item with Converter&lt;T&gt; when it is consumed, and waits with the GIL released while empty.</para>
+    /// <para>Iteration ends once a producer calls Close and the buffered items have been consumed.</para>
+    /// </summary>
+    template<typename T>
+    class Stream : public Object
+    {
+    private:
+        struct State;
+
+    public:
+        /// <summary>
+        /// What Push does when the buffer is full.
+        /// </summary>
+        enum class Overflow
+        {
+            Block,       // wait until the consumer makes room
+            DropNewest,  // discard the item being pushed
+            DropOldest,  // discard the oldest buffered item
+        };
+
+        /// <summary>
+        /// Producer handle, usable from any C++ thread without the GIL. Handles keep the buffer alive.
+        /// </summary>
+        class Producer
+        {
+        public:
+            /// <summary>
+            /// Add an item to the stream.
+            /// Returns false if the item was dropped or the stream is closed.
+            /// </summary>
+            bool Push(T value) const
+            {
+                return state->Push(std::move(value));
+            }
+
+            /// <summary>
+            /// Mark the end of the stream; the consumer stops after the buffered items.
+            /// </summary>
+            void Close() const
+            {
+                state->Close(false);
+            }
+
+            /// <summary>
+            /// Determine if the stream was closed by a producer or by the consumer.
+            /// </summary>
+            bool IsClosed() const
+            {
+                return state->closed.load(std::memory_order_acquire);
+            }
+
+        private:
+            friend class Stream;
+
+            Producer(std::shared_ptr<State> state)
+                : state(std::move(state))
+            { }
+
+            std::shared_ptr<State> state;
+        };
+
+        Stream(const Object& obj)
+            : Object(obj)
+        { }
+
+        Stream(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Create a stream buffering up to capacity items, rounded up to a power of two.
+        /// </summary>
+        Stream(size_t capacity, Overflow overflow = Overflow::Block)
+            : Object(NativeType<Holder>::New(GetType(), std::make_shared<State>(capacity, overflow)), false)
+        { }
+
+        /// <summary>
+        /// Get a handle for pushing items.
+        /// </summary>
+        Producer GetProducer() const
+        {
+            return Producer(NativeType<Holder>::Get(ptr).state);
+        }
+
+        /// <summary>
+        /// Get the number of items discarded by the overflow policy.
+        /// </summary>
+        size_t GetDropped() const
+        {
+            return NativeType<Holder>::Get(ptr).state->dropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct State
+        {
+            State(size_t capacity, Overflow overflow)
+                : ring(capacity)
+                , overflow(overflow)
+            { }
+
+            bool IsReadable() const
+            {
+                return !ring.IsEmpty() || closed.load(std::memory_order_acquire);
+            }
+
+            bool IsWritable() const
+            {
+                return !ring.IsFull() || closed.load(std::memory_order_acquire);
+            }
+
+            bool Push(T value)
+            {
+                while (!closed.load(std::memory_order_acquire))
+                {
+                    if (ring.TryPush(value))
+                    {
+                        ring.Notify(ring.readable);
+                        return true;
+                    }
+                    if (overflow == Overflow::DropNewest)
+                    {
+                        dropped.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    if (overflow == Overflow::DropOldest)
+                    {
+                        // The ring is multi-consumer, so a producer can evict safely.
+                        if (ring.TryPop())
+                            dropped.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    ring.Wait(ring.writable, [this] { return IsWritable(); });
+                }
+                return false;
+            }
+
+            void Close(bool discard)
+            {
+                closed.store(true, std::memory_order_release);
+                if (discard)
+                    while (ring.TryPop())
+                        ;
+                ring.Notify(ring.readable);
+                ring.Notify(ring.writable);
+            }
+
+            Ring<T> ring;
+            Overflow overflow;
+            std::atomic<bool> closed = false;
+            std::atomic<size_t> dropped = 0;
+        };
+
+        struct Holder
+        {
+            Holder(std::shared_ptr<State> state)
+                : state(std::move(state))
+            { }
+
+            ~Holder()
+            {
+                // The consumer is gone, unblock producers and release what they buffered.
+                state->Close(true);
+            }
+
+            std::shared_ptr<State> state;
+        };
+
+        static PyTypeObject* GetType()
+        {
+            static PyMethodDef methods[] = {
+                { "close", (PyCFunction)(void*)&PyClose, METH_NOARGS, "Stop consuming: discard buffered items and make further pushes fail." },
+                { }
+            };
+            static PyGetSetDef getset[] = {
+                { "dropped", (getter)&PyDropped, nullptr, "Number of items discarded because the buffer was full.", nullptr },
+                { }
+            };
+            static PyTypeObject* type = NativeType<Holder>::Create("Py.Stream", {
+                { Py_tp_iter, (void*)&PyObject_SelfIter },
+                { Py_tp_iternext, (void*)&PyNext },
+                { Py_tp_methods, (void*)methods },
+                { Py_tp_getset, (void*)getset },
+            });
+            return type;
+        }
+
+        static PyObject* PyNext(PyObject* self)
+        {
+            State& state = *NativeType<Holder>::Get(self).state;
+            for (;;)
+            {
+                // Read the flag first: an item pushed before Close is then guaranteed to be seen by TryPop.
+                bool closed = state.closed.load(std::memory_order_acquire);
+                if (std::optional<T> item = state.ring.TryPop())
+                {
+                    state.ring.Notify(state.ring.writable);
+                    return Converter<T>::ToPython(*item);
+                }
+                if (closed)
+                    return nullptr;
+                bool ready;
+                Py_BEGIN_ALLOW_THREADS
+                ready = state.ring.Wait(state.ring.readable, [&state] { return state.IsReadable(); }, std::chrono::milliseconds(50));
+                Py_END_ALLOW_THREADS
+                // Wake up periodically so that KeyboardInterrupt is not delayed until the next item.
+                if (!ready && PyErr_CheckSignals())
+                    return nullptr;
+            }
+        }
+
+        static PyObject* PyClose(PyObject* self, PyObject*)
+        {
+            NativeType<Holder>::Get(self).state->Close(true);
+            Py_RETURN_NONE;
+        }
+
+        static PyObject* PyDropped(PyObject* self, void*)
+        {
+            return PyLong_FromSize_t(NativeType<Holder>::Get(self).state->dropped.load(std::memory_order_relaxed));
+        }
+    };
+
+    /// <summary>
+    /// Bounded FIFO of Python objects shared by C++ and Python threads, backed by a lock-free Ring.
+    /// <para>C++ threads push and pop without the GIL: references travel through the ring untouched, so refcounts are
+    /// only changed by the side that holds the GIL. Python sees a queue.Queue-like object whose blocking calls wait
+    /// with the GIL released, plus get_many to drain a batch in one call.</para>
+    /// <para>Queue is an Object, so copying or dropping it needs the GIL; producer threads use a Producer handle instead.
+    /// Items left in the queue are released with it, and pushes after that are refused.</para>
+    /// </summary>
+    class Queue : public Object
+    {
+    private:
+        struct Buffer;
+
+    public:
+        /// <summary>
+        /// Producer handle, usable from any C++ thread without the GIL. Handles keep the buffer alive, not the queue.
+        /// </summary>
+        class Producer
+        {
+        public:
+            /// <summary>
+            /// Add an item without blocking, stealing the reference.
+            /// Returns false if the queue is full or gone, in which case the caller keeps the reference.
+            /// </summary>
+            bool TryPush(PyObject* item) const
+            {
+                return buffer->TryPush(item);
+            }
+
+            /// <summary>
+            /// Add an item, waiting for room. Steals the reference unless the queue is gone, which returns false.
+            /// </summary>
+            bool Push(PyObject* item) const
+            {
+                return buffer->Push(item);
+            }
+
+        private:
+            friend class Queue;
+
+            Producer(std::shared_ptr<Buffer> buffer)
+                : buffer(std::move(buffer))
+            { }
+
+            std::shared_ptr<Buffer> buffer;
+        };
+
+        Queue(const Object& obj)
+            : Object(obj)
+        { }
+
+        Queue(PyObject* obj, bool addref = true)
+            : Object(obj, addref)
+        { }
+
+        /// <summary>
+        /// Create a queue holding up to capacity items, rounded up to a power of two.
+        /// </summary>
+        explicit Queue(size_t capacity)
+            : Object(NativeType<State>::New(GetType(), capacity), false)
+        { }
+
+        /// <summary>
+        /// Add an item without the GIL, stealing the reference.
+        /// Returns false if the queue is full, in which case the caller keeps the reference.
+        /// </summary>
+        bool TryPush(PyObject* item) const
+        {
+            return NativeType<State>::Get(ptr).buffer->TryPush(item);
+        }
+
+        /// <summary>
+        /// Add an item, waiting for room. Steals the reference. Must be called without holding the GIL.
+        /// </summary>
+        void Push(PyObject* item) const
+        {
+            NativeType<State>::Get(ptr).buffer->Push(item);
+        }
+
+        /// <summary>
+        /// Get a handle for pushing items from threads that do not hold the GIL.
+        /// </summary>
+        Producer GetProducer() const
+        {
+            return Producer(NativeType<State>::Get(ptr).buffer);
+        }
+
+        /// <summary>
+        /// Remove an item, or return nullptr if the queue is empty. Must be called while holding the GIL, because the
+        /// garbage collector walks the queued items.
+        /// The caller owns the returned reference.
+        /// </summary>
+        PyObject* TryPop() const
+        {
+            Ring<PyObject*>& ring = NativeType<State>::Get(ptr).ring;
+            std::optional<PyObject*> item = ring.TryPop();
+            if (!item)
+                return nullptr;
+            ring.Notify(ring.writable);
+            return *item;
+        }
+
+        /// <summary>
+        /// Get the approximate number of queued items.
+        /// </summary>
+        size_t GetSize() const
+        {
+            return NativeType<State>::Get(ptr).ring.GetSize();
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        /// <summary>
+        /// Ring shared with the producer handles. Close refuses further pushes and releases what is left.
+        /// </summary>
+        struct Buffer
+        {
+            Buffer(size_t capacity)
+                : ring(capacity)
+            { }
+
+            bool TryPush(PyObject* item)
+            {
+                // Pairs with Close: either Close sees this push in flight and waits for it, or the push sees closed.
+                pushing.fetch_add(1);
+                bool pushed = !closed.load() && ring.TryPush(item);
+                pushing.fetch_sub(1);
+                if (pushed)
+                    ring.Notify(ring.readable);
+                return pushed;
+            }
+
+            bool Push(PyObject* item)
+            {
+                while (!TryPush(item))
+                {
+                    if (closed.load())
+                        return false;
+                    ring.Wait(ring.writable, [this] { return !ring.IsFull() || closed.load(); });
+                }
+                return true;
+            }
+
+            /// <summary>
+            /// Must be called while holding the GIL.
+            /// </summary>
+            void Close()
+            {
+                closed.store(true);
+                ring.Notify(ring.writable);
+                while (pushing.load() != 0)
+                    std::this_thread::yield();
+                Clear();
+            }
+
+            /// <summary>
+            /// Release the queued items. Must be called while holding the GIL.
+            /// </summary>
+            void Clear()
+            {
+                while (std::optional<PyObject*> item = ring.TryPop())
+                    Py_DECREF(*item);
+                ring.Notify(ring.writable);
+            }
+
+            Ring<PyObject*> ring;
+            std::atomic<size_t> pushing = 0;
+            std::atomic<bool> closed = false;
+        };
+
+        struct State
+        {
+            State(size_t capacity)
+                : buffer(std::make_shared<Buffer>(capacity))
+                , ring(buffer->ring)
+            {
+                Module queue(Str("queue"));
+                if (!queue)
+                    throw;
+                empty.SetObject(queue.GetAttr("Empty"));
+                full.SetObject(queue.GetAttr("Full"));
+                if (!empty || !full)
+                    throw;
+            }
+
+            ~State()
+            {
+                // Instances are deallocated while holding the GIL.
+                buffer->Close();
+            }
+
+            std::shared_ptr<Buffer> buffer;
+            Ring<PyObject*>& ring;
+            Object empty;
+            Object full;
+        };
+
+        static PyTypeObject* GetType()
+        {
+            static PyMethodDef methods[] = {
+                { "put", (PyCFunction)(void*)&PyPut, METH_FASTCALL | METH_KEYWORDS, "put(item, block=True, timeout=None)\n--\n\nPut an item into the queue." },
+                { "put_nowait", (PyCFunction)(void*)&PyPutNoWait, METH_O, "Put an item into the queue without blocking." },
+                { "get", (PyCFunction)(void*)&PyGet, METH_FASTCALL | METH_KEYWORDS, "get(block=True, timeout=None)\n--\n\nRemove and return an item from the queue." },
+                { "get_nowait", (PyCFunction)(void*)&PyGetNoWait, METH_NOARGS, "Remove and return an item from the queue without blocking." },
+                { "get_many", (PyCFunction)(void*)&PyGetMany, METH_FASTCALL | METH_KEYWORDS, "get_many(max_items, block=True, timeout=None)\n--\n\n"
+                    "Remove up to max_items items and return them as a list.\nWaits like get() for the first item; returns an empty list if none arrives without blocking." },
+                { "qsize", (PyCFunction)(void*)&PySize, METH_NOARGS, "Return the approximate size of the queue." },
+                { "empty", (PyCFunction)(void*)&PyEmpty, METH_NOARGS, "Return True if the queue is empty." },
+                { "full", (PyCFunction)(void*)&PyFull, METH_NOARGS, "Return True if the queue is full." },
+                { }
+            };
+            static PyGetSetDef getset[] = {
+                { "maxsize", (getter)&PyMaxSize, nullptr, "Capacity of the queue.", nullptr },
+                { }
+            };
+            static PyTypeObject* type = NativeType<State>::Create("Py.Queue", {
+                { Py_tp_methods, (void*)methods },
+                { Py_tp_getset, (void*)getset },
+                { Py_tp_traverse, (void*)&Traverse },
+                { Py_tp_clear, (void*)&ClearSlot },
+            }, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC);
+            return type;
+        }
+
+        static int Traverse(PyObject* self, visitproc visit, void* arg)
+        {
+            State& state = NativeType<State>::Get(self);
+            Py_VISIT(Py_TYPE(self));
+            Py_VISIT((PyObject*)state.empty);
+            Py_VISIT((PyObject*)state.full);
+            // Producers may push meanwhile; an item missed here only looks externally referenced, which is safe.
+            int result = 0;
+            state.ring.ForEach([&](PyObject* item) { if (result == 0) result = visit(item, arg); });
+            return result;
+        }
+
+        static int ClearSlot(PyObject* self)
+        {
+            NativeType<State>::Get(self).buffer->Clear();
+            return 0;
+        }
+
+        /// <summary>
+        /// Match vectorcall arguments against parameter names. Missing optional values are left null.
+        /// </summary>
+        static bool ParseArgs(const char* function, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames,
+            std::initializer_list<const char*> names, size_t required, PyObject** values)
+        {
+            if ((size_t)nargs > names.size())
+            {
+                PyErr_Format(PyExc_TypeError, "%s() takes at most %zu arguments (%zd given)", function, names.size(), nargs);
+                return false;
+            }
+            std::fill(values, values + names.size(), nullptr);
+            std::copy(args, args + nargs, values);
+            for (Py_ssize_t i = 0; kwnames && i < PyTuple_GET_SIZE(kwnames); ++i)
+            {
+                PyObject* key = PyTuple_GET_ITEM(kwnames, i);
+                size_t index = 0;
+                for (const char* name : names)
+                {
+                    if (PyUnicode_CompareWithASCIIString(key, name) == 0)
+                        break;
+                    ++index;
+                }
+                if (index == names.size() || values[index] != nullptr)
+                {
+                    PyErr_Format(PyExc_TypeError, index == names.size() ? "%s() got an unexpected keyword argument '%U'"
+                        : "%s() got multiple values for argument '%U'", function, key);
+                    return false;
+                }
+                values[index] = args[nargs + i];
+            }
+            for (size_t i = 0; i < required; ++i)
+            {
+                if (values[i] == nullptr)
+                {
+                    PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", function, names.begin()[i]);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Convert the block and timeout arguments into a deadline; Clock::time_point::max() waits forever.
+        /// </summary>
+        static bool GetDeadline(PyObject* block, PyObject* timeout, bool& blocking, Clock::time_point& deadline)
+        {
+            int value = block ? PyObject_IsTrue(block) : 1;
+            if (value < 0)
+                return false;
+            blocking = value;
+            deadline = Clock::time_point::max();
+            if (!blocking || timeout == nullptr || timeout == Py_None)
+                return true;
+            double seconds = PyFloat_AsDouble(timeout);
+            if (seconds == -1 && PyErr_Occurred())
+                return false;
+            if (seconds < 0)
+            {
+                PyErr_SetString(PyExc_ValueError, "'timeout' must be a non-negative number");
+                return false;
+            }
+            deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+            return true;
+        }
+
+        /// <summary>
+        /// Wait with the GIL released until ready() holds. Sets the timeout exception, or the one raised by a signal handler,
+        /// and returns false otherwise.
+        /// </summary>
+        template<typename Predicate>
+        static bool Wait(State& state, Ring<PyObject*>::Event& event, Predicate ready, Clock::time_point deadline, PyObject* timeout)
+        {
+            for (;;)
+            {
+                Clock::time_point now = Clock::now();
+                if (now >= deadline)
+                {
+                    PyErr_SetNone(timeout);
+                    return false;
+                }
+                // Wake up periodically so that KeyboardInterrupt is not delayed.
+                auto slice = std::min<std::chrono::milliseconds>(std::chrono::milliseconds(50),
+                    std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+                bool result;
+                Py_BEGIN_ALLOW_THREADS
+                result = state.ring.Wait(event, ready, slice);
+                Py_END_ALLOW_THREADS
+                if (result)
+                    return true;
+                if (PyErr_CheckSignals())
+                    return false;
+            }
+        }
+
+        static PyObject* Put(State& state, PyObject* item, bool block, Clock::time_point deadline)
+        {
+            PyObject* value = Py_NewRef(item);
+            while (!state.ring.TryPush(value))
+            {
+                if (!block)
+                    PyErr_SetNone(state.full);
+                if (!block || !Wait(state, state.ring.writable, [&state] { return !state.ring.IsFull(); }, deadline, state.full))
+                {
+                    Py_DECREF(value);
+                    return nullptr;
+                }
+            }
+            state.ring.Notify(state.ring.readable);
+            Py_RETURN_NONE;
+        }
+
+        static PyObject* Get(State& state, bool block, Clock::time_point deadline)
+        {
+            for (;;)
+            {
+                if (std::optional<PyObject*> item = state.ring.TryPop())
+                {
+                    state.ring.Notify(state.ring.writable);
+                    return *item;
+                }
+                if (!block)
+                {
+                    PyErr_SetNone(state.empty);
+                    return nullptr;
+                }
+                if (!Wait(state, state.ring.readable, [&state] { return !state.ring.IsEmpty(); }, deadline, state.empty))
+                    return nullptr;
+            }
+        }
+
+        static PyObject* PyPut(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+        {
+            PyObject* values[3];
+            bool block;
+            Clock::time_point deadline;
+            if (!ParseArgs("put", args, nargs, kwnames, { "item", "block", "timeout" }, 1, values)
+                || !GetDeadline(values[1], values[2], block, deadline))
+                return nullptr;
+            return Put(NativeType<State>::Get(self), values[0], block, deadline);
+        }
+
+        static PyObject* PyPutNoWait(PyObject* self, PyObject* item)
+        {
+            return Put(NativeType<State>::Get(self), item, false, Clock::time_point::max());
+        }
+
+        static PyObject* PyGet(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+        {
+            PyObject* values[2];
+            bool block;
+            Clock::time_point deadline;
+            if (!ParseArgs("get", args, nargs, kwnames, { "block", "timeout" }, 0, values)
+                || !GetDeadline(values[0], values[1], block, deadline))
+                return nullptr;
+            return Get(NativeType<State>::Get(self), block, deadline);
+        }
+
+        static PyObject* PyGetNoWait(PyObject* self, PyObject*)
+        {
+            return Get(NativeType<State>::Get(self), false, Clock::time_point::max());
+        }
+
+        static PyObject* PyGetMany(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+        {
+            PyObject* values[3];
+            bool block;
+            Clock::time_point deadline;
+            if (!ParseArgs("get_many", args, nargs, kwnames, { "max_items", "block", "timeout" }, 1, values)
+                || !GetDeadline(values[1], values[2], block, deadline))
+                return nullptr;
+            Py_ssize_t limit = PyLong_AsSsize_t(values[0]);
+            if (limit == -1 && PyErr_Occurred())
+                return nullptr;
+            State& state = NativeType<State>::Get(self);
+            Object list = Py_ObjWrap(PyList_New(0));
+            if (!list)
+                return nullptr;
+            if (limit <= 0)
+                return list.AddRef();
+            if (block)
+            {
+                Object first = Py_ObjWrap(Get(state, true, deadline));
+                if (!first || PyList_Append(list, first))
+                    return nullptr;
+            }
+            while (PyList_GET_SIZE((PyObject*)list) < limit)
+            {
+                std::optional<PyObject*> item = state.ring.TryPop();
+                if (!item)
+                    break;
+                Object value = Py_ObjWrap(*item);
+                if (PyList_Append(list, value))
+                    return nullptr;
+            }
+            state.ring.Notify(state.ring.writable);
+            return list.AddRef();
+        }
+
+        static PyObject* PySize(PyObject* self, PyObject*)
+        {
+            return PyLong_FromSize_t(NativeType<State>::Get(self).ring.GetSize());
+        }
+
+        static PyObject* PyEmpty(PyObject* self, PyObject*)
+        {
+            return PyBool_FromLong(NativeType<State>::Get(self).ring.IsEmpty());
+        }
+
+        static PyObject* PyFull(PyObject* self, PyObject*)
+        {
+            return PyBool_FromLong(NativeType<State>::Get(self).ring.IsFull());
+        }
+
+        static PyObject* PyMaxSize(PyObject* self, void*)
+        {
+            return PyLong_FromSize_t(NativeType<State>::Get(self).ring.GetCapacity());
+        }
     };
 
     /// <summary>